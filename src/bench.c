@@ -0,0 +1,468 @@
+/**
+ * An automatic synchronizer for removable media.<br/>
+ *
+ * <p>
+ * Copyright (C) 2010 Willian Paixao <willian@ufpa.br>
+ *
+ * This program is free software: you can redistribute it and/or modify<br/>
+ * it under the terms of the GNU General Public License as published by<br/>
+ * the Free Software Foundation, either version 3 of the License, or<br/>
+ * (at your option) any later version.<br/>
+ *
+ * This program is distributed in the hope that it will be useful,<br/>
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of<br/>
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.<br/>
+ * See the GNU General Public License for more details.<br/>
+ *
+ * You should have received a copy of the GNU General Public License<br/>
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ * </p>
+ *
+ * \file bench.c
+ * \brief Benchmark of the sync routines.
+ * Built by <code>make bench</code> against <code>cpusb.c</code>, whose
+ * <code>main()</code> is renamed away. Creates synthetic trees, always the
+ * same ones, in a temporary directory, syncs them and prints one JSON
+ * object per test on the standard output.
+ *
+ * Usage: <code>cpusb-bench [-j workers] [-s scale] [directory]</code>
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The parts of cpusb.c used here.
+ */
+extern char *dev_path, *src_path, *manifest_path;
+extern long quiet_window, max_latency, workers;
+int sync_dir (const char *from_path, const char *to_path);
+void cpusb_daemon ();
+
+/**
+ * \def LATENCY_SAMPLES
+ * Number of files written to measure the daemon.
+ */
+#define LATENCY_SAMPLES 200
+
+/**
+ * \var uint64_t seed
+ * State of the generator of contents, reset for every tree.
+ */
+uint64_t seed;
+
+/**
+ * \var long scale
+ * Multiplies the number of files of every tree.
+ */
+long scale = 1;
+
+/**
+ * \brief Next number of a xorshift64 generator.
+ */
+uint64_t
+next_random ()
+{
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        return seed;
+}
+
+/**
+ * \brief Seconds of the monotonic clock.
+ */
+double
+now ()
+{
+        struct timespec ts;
+
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * \brief Makes <code>path</code> and all its parents.
+ */
+void
+make_dirs (const char *path)
+{
+        char buf[PATH_MAX], *p;
+
+        snprintf (buf, PATH_MAX, "%s", path);
+        for (p = buf + 1; *p; p++)
+                if (*p == '/')
+                {
+                        *p = '\0';
+                        mkdir (buf, S_IRWXU);
+                        *p = '/';
+                }
+        mkdir (buf, S_IRWXU);
+}
+
+/**
+ * \brief Writes <code>size</code> pseudo-random bytes in <code>path</code>.
+ * \return Bytes written.
+ */
+off_t
+write_file (const char *path, off_t size)
+{
+        char buf[64 * 1024];
+        int fd;
+        off_t done = 0;
+        size_t i, len;
+        uint64_t r;
+
+        fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd < 0)
+        {
+                perror (path);
+                exit (EXIT_FAILURE);
+        }
+
+        while (done < size)
+        {
+                len = size - done < (off_t) sizeof (buf) ? size - done : sizeof (buf);
+                for (i = 0; i < len; i += sizeof (r))
+                {
+                        r = next_random ();
+                        memcpy (buf + i, &r, len - i < sizeof (r) ? len - i : sizeof (r));
+                }
+                if (write (fd, buf, len) != (ssize_t) len)
+                {
+                        perror (path);
+                        exit (EXIT_FAILURE);
+                }
+                done += len;
+        }
+        close (fd);
+
+        return done;
+}
+
+/**
+ * \brief Makes a sparse file of <code>size</code> bytes with a few extents.
+ * \return Bytes of data, the holes not counted.
+ */
+off_t
+write_sparse (const char *path, off_t size)
+{
+        char buf[64 * 1024];
+        int fd, i;
+        off_t data = 0;
+
+        memset (buf, 'x', sizeof (buf));
+        fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd < 0 || ftruncate (fd, size))
+        {
+                perror (path);
+                exit (EXIT_FAILURE);
+        }
+        for (i = 0; i < 16; i++)
+                data += pwrite (fd, buf, sizeof (buf), (next_random () % (size / sizeof (buf))) * sizeof (buf));
+        close (fd);
+
+        return data;
+}
+
+/**
+ * \brief One of the synthetic trees.
+ */
+struct tree
+{
+        const char *name;
+        long files;
+        long bytes;
+};
+
+/**
+ * \brief Builds the tree <code>name</code> in <code>dir</code>.
+ * \return How many files and bytes it has.
+ */
+struct tree
+make_tree (const char *dir, const char *name)
+{
+        char path[PATH_MAX];
+        long i, j;
+        struct tree tree = {name, 0, 0};
+
+        seed = 88172645463325252ULL;
+        make_dirs (dir);
+
+        if (!strcmp (name, "tiny"))
+                for (i = 0; i < 50; i++)
+                        for (j = 0; j < 100 * scale; j++)
+                        {
+                                snprintf (path, PATH_MAX, "%s/d%03ld", dir, i);
+                                make_dirs (path);
+                                snprintf (path, PATH_MAX, "%s/d%03ld/f%05ld", dir, i, j);
+                                tree.bytes += write_file (path, 1 + next_random () % 4096);
+                                tree.files++;
+                        }
+        else if (!strcmp (name, "huge"))
+                for (i = 0; i < 3; i++)
+                {
+                        snprintf (path, PATH_MAX, "%s/huge%ld", dir, i);
+                        tree.bytes += write_file (path, 64L * 1024 * 1024 * scale);
+                        tree.files++;
+                }
+        else if (!strcmp (name, "deep"))
+        {
+                snprintf (path, PATH_MAX, "%s", dir);
+                for (i = 0; i < 64; i++)
+                {
+                        snprintf (path + strlen (path), PATH_MAX - strlen (path), "/n%02ld", i);
+                        make_dirs (path);
+                        for (j = 0; j < 4 * scale; j++)
+                        {
+                                char file[PATH_MAX + 32];
+
+                                snprintf (file, sizeof (file), "%s/f%ld", path, j);
+                                tree.bytes += write_file (file, 1 + next_random () % 8192);
+                                tree.files++;
+                        }
+                }
+        }
+        else if (!strcmp (name, "wide"))
+                for (i = 0; i < 20000 * scale; i++)
+                {
+                        snprintf (path, PATH_MAX, "%s/w%07ld", dir, i);
+                        tree.bytes += write_file (path, 100);
+                        tree.files++;
+                }
+        else if (!strcmp (name, "sparse"))
+                for (i = 0; i < 4; i++)
+                {
+                        snprintf (path, PATH_MAX, "%s/sparse%ld", dir, i);
+                        tree.bytes += write_sparse (path, 256L * 1024 * 1024 * scale);
+                        tree.files++;
+                }
+
+        return tree;
+}
+
+/**
+ * \var long changed
+ * Files rewritten by <code>touch_some()</code>.
+ *
+ * \var long changed_bytes
+ * Bytes written by <code>touch_some()</code>.
+ */
+long changed, changed_bytes;
+
+/**
+ * \brief Rewrites about one file in a hundred, for <code>nftw()</code>.
+ */
+int
+touch_some (const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+        if (type == FTW_F && next_random () % 100 == 0)
+        {
+                changed_bytes += write_file (path, sb->st_size ? sb->st_size : 1);
+                changed++;
+        }
+
+        return 0;
+}
+
+/**
+ * \brief Removes one entry, for <code>nftw()</code>.
+ */
+int
+remove_entry (const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+        return remove (path);
+}
+
+/**
+ * \brief Prints the result of a sync test. <code>files</code> and
+ * <code>bytes</code> are the tree walked, <code>changed</code> and
+ * <code>changed_bytes</code> what the test had to copy of it.
+ */
+void
+print_sync (const char *test, const struct tree *tree, long changed, long changed_bytes, double secs)
+{
+        printf ("{\"test\": \"%s\", \"tree\": \"%s\", \"workers\": %ld, \"files\": %ld, \"bytes\": %ld, "
+                "\"changed\": %ld, \"changed_bytes\": %ld, "
+                "\"seconds\": %.6f, \"files_per_sec\": %.1f, \"mb_per_sec\": %.2f}\n",
+                test, tree->name, workers, tree->files, tree->bytes, changed, changed_bytes, secs,
+                tree->files / secs, tree->bytes / secs / (1024 * 1024));
+        fflush (stdout);
+}
+
+/**
+ * \brief Full and incremental syncs of the tree <code>name</code>.
+ */
+void
+bench_tree (const char *base, const char *name)
+{
+        char dev[PATH_MAX], src[PATH_MAX], man[PATH_MAX];
+        double t;
+        struct tree tree;
+
+        snprintf (dev, PATH_MAX, "%s/%s/dev", base, name);
+        snprintf (src, PATH_MAX, "%s/%s/src", base, name);
+        snprintf (man, PATH_MAX, "%s/%s/manifest", base, name);
+        manifest_path = man;
+
+        tree = make_tree (dev, name);
+        make_dirs (src);
+        sync ();
+
+        t = now ();
+        sync_dir (dev, src);
+        print_sync ("full", &tree, tree.files, tree.bytes, now () - t);
+
+        t = now ();
+        sync_dir (dev, src);
+        print_sync ("unchanged", &tree, 0, 0, now () - t);
+
+        changed = changed_bytes = 0;
+        nftw (dev, touch_some, 16, FTW_PHYS);
+        t = now ();
+        sync_dir (dev, src);
+        print_sync ("incremental", &tree, changed, changed_bytes, now () - t);
+
+        snprintf (dev, PATH_MAX, "%s/%s", base, name);
+        nftw (dev, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * \brief Runs <code>cpusb_daemon()</code>, which never returns.
+ */
+void *
+run_daemon (void *arg)
+{
+        cpusb_daemon ();
+
+        return NULL;
+}
+
+/**
+ * \brief Orders two doubles, for <code>qsort()</code>.
+ */
+int
+cmp_double (const void *a, const void *b)
+{
+        double x = *(const double *) a, y = *(const double *) b;
+
+        return (x > y) - (x < y);
+}
+
+/**
+ * \brief Time from closing a file on the device to seeing it on the source.
+ */
+void
+bench_latency (const char *base)
+{
+        char dev[PATH_MAX], src[PATH_MAX], path[PATH_MAX + 32];
+        double samples[LATENCY_SAMPLES], t;
+        int i, n = 0, lost = 0;
+        pthread_t thread;
+        struct stat sb;
+        struct tree tree;
+
+        snprintf (dev, PATH_MAX, "%s/latency/dev", base);
+        snprintf (src, PATH_MAX, "%s/latency/src", base);
+        tree = make_tree (dev, "tiny");
+        make_dirs (src);
+        manifest_path = NULL;
+        sync_dir (dev, src);
+
+        dev_path = dev;
+        src_path = src;
+        if (pthread_create (&thread, NULL, run_daemon, NULL))
+        {
+                perror ("pthread_create");
+                return;
+        }
+        usleep (300000);
+
+        for (i = 0; i < LATENCY_SAMPLES; i++)
+        {
+                snprintf (path, sizeof (path), "%s/d%03d/new%04d", dev, i % 50, i);
+                write_file (path, 1024);
+                t = now ();
+
+                snprintf (path, sizeof (path), "%s/d%03d/new%04d", src, i % 50, i);
+                while ((stat (path, &sb) || sb.st_size != 1024) && now () - t < 5)
+                        usleep (100);
+                if (now () - t < 5)
+                        samples[n++] = (now () - t) * 1000;
+                else
+                        lost++;
+        }
+
+        qsort (samples, n, sizeof (double), cmp_double);
+        printf ("{\"test\": \"latency\", \"tree\": \"%s\", \"quiet_window_ms\": %ld, \"samples\": %d, \"lost\": %d, "
+                "\"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}\n",
+                tree.name, quiet_window, n, lost,
+                n ? samples[n / 2] : 0, n ? samples[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1] : 0,
+                n ? samples[n - 1] : 0);
+        fflush (stdout);
+}
+
+/**
+ * \brief The main function.
+ * Runs every test, the daemon one at last, because its thread never ends.
+ */
+int
+main (int argc, char *argv[])
+{
+        char base[PATH_MAX];
+        const char *dir = "/tmp";
+        const char *trees[] = {"tiny", "huge", "deep", "wide", "sparse", NULL};
+        int c, i;
+
+        while ((c = getopt (argc, argv, "j:s:")) != -1)
+                switch (c)
+                {
+                        case 'j':
+                                workers = strtol (optarg, NULL, 10);
+                                break;
+                        case 's':
+                                scale = strtol (optarg, NULL, 10);
+                                break;
+                        default:
+                                fprintf (stderr, "Usage: %s [-j workers] [-s scale] [directory]\n", argv[0]);
+                                return EXIT_FAILURE;
+                }
+        if (optind < argc)
+                dir = argv[optind];
+
+        snprintf (base, PATH_MAX, "%s/cpusb-bench.XXXXXX", dir);
+        if (mkdtemp (base) == NULL)
+        {
+                perror (base);
+                return EXIT_FAILURE;
+        }
+
+        for (i = 0; trees[i]; i++)
+                bench_tree (base, trees[i]);
+
+        /* The daemon answers as soon as the events stop. */
+        quiet_window = 1;
+        max_latency = 50;
+        bench_latency (base);
+
+        nftw (base, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+        return EXIT_SUCCESS;
+}
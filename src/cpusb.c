@@ -42,18 +42,89 @@
 #define CONFORMING 1
 #endif
 
+#ifndef _GNU_SOURCE
+/**
+ * \def _GNU_SOURCE
+ * Exposes the Linux extensions, like <code>copy_file_range()</code>.
+ */
+#define _GNU_SOURCE 1
+#endif
+
 /**
  * \def Kb
  * Length of Kilo byte.
  */
 #define Kb 1024
 
+/**
+ * \def COPY_BUF
+ * Length of the buffer used when the kernel can't copy by itself.
+ */
+#define COPY_BUF (1024 * Kb)
+
+/**
+ * \def DELTA_BLOCK
+ * Length of the blocks compared by <code>copy_delta()</code>, a divisor
+ * of <code>COPY_BUF</code>.
+ */
+#define DELTA_BLOCK (64 * Kb)
+
+/**
+ * \def URING_BLOCK
+ * Length of each registered buffer of <code>copy_uring()</code>.
+ */
+#define URING_BLOCK (256 * Kb)
+
+/**
+ * \def STREAM_WINDOW
+ * Bytes read ahead, and dropped behind, at once by <code>copy_stream()</code>.
+ */
+#define STREAM_WINDOW (8 * COPY_BUF)
+
+/**
+ * \def STREAM_ALIGN
+ * Alignment of the buffers, offsets and lengths of <code>O_DIRECT</code>.
+ */
+#define STREAM_ALIGN 4096
+
+/**
+ * \def EVENT_BUF
+ * Length of the buffer for inotify events.
+ */
+#define EVENT_BUF (64 * Kb)
+
+/**
+ * \def SCAN_BUF
+ * Length of the buffer filled by <code>getdents64</code>, enough for
+ * most directories at once.
+ */
+#define SCAN_BUF (256 * Kb)
+
 /**
  * \def LOG_PATH
  * Where put the log file
  */
 #define LOG_PATH "/var/log"
 
+/**
+ * \def LOG_SLOTS
+ * Messages the log ring holds, a power of two. When it is full, new
+ * messages are dropped and counted.
+ */
+#define LOG_SLOTS 1024
+
+/**
+ * \def LOG_LINE
+ * Longest message kept by the log ring, longer ones are cut.
+ */
+#define LOG_LINE 256
+
+/**
+ * \def LOG_RATE_SLOTS
+ * Distinct error messages followed by the rate limit at once.
+ */
+#define LOG_RATE_SLOTS 64
+
 /* 
  * The includes of life.
  *
@@ -73,18 +144,46 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <linux/ioprio.h>
+#include <linux/magic.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <signal.h>
 #include <readline/history.h>
 #include <readline/readline.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef EXFAT_SUPER_MAGIC
+/**
+ * \def EXFAT_SUPER_MAGIC
+ * Filesystem type of exFAT, missing from older kernel headers.
+ */
+#define EXFAT_SUPER_MAGIC 0x2011BAB0
+#endif
+
 /**
  * \var char *dev_path
  * The path of device directory.
@@ -97,501 +196,7340 @@
  */
 char *dev_path, *src_path;
 
+/**
+ * \var char *device_uuid
+ * UUID of the filesystem of the device, as in <code>/dev/disk/by-uuid</code>.
+ *
+ * \var char *device_label
+ * Label of the filesystem of the device, as in <code>/dev/disk/by-label</code>.
+ *
+ * With any of them, the device directory is wherever that filesystem is
+ * mounted, and <code>dev_path</code> is NULL while it isn't.
+ */
+char *device_uuid, *device_label;
+
+/**
+ * \var int mount_fd
+ * <code>/proc/self/mountinfo</code>, open while the daemon waits for
+ * devices, -1 otherwise. The kernel wakes its pollers up with
+ * <code>POLLPRI</code> when anything is mounted or unmounted.
+ *
+ * \var int mount_changed
+ * Set when <code>sync_cancelled()</code> took a wake up of
+ * <code>mount_fd</code>, so the daemon still looks at the mounts.
+ *
+ * \var int sync_stop
+ * Set when the device being synced went away; the rest of the sync is
+ * skipped, and its manifest not written.
+ */
+int mount_fd = -1, mount_changed, sync_stop;
+
+/**
+ * \var long quiet_window
+ * Milliseconds without events before the daemon syncs what changed.
+ *
+ * \var long max_latency
+ * Maximum milliseconds a change waits, even if events keep coming.
+ */
+long quiet_window = 100, max_latency = 1000;
+
+/**
+ * \var long workers
+ * Number of threads of a full sync pass, 1 keeps it in the main thread.
+ */
+long workers = 1;
+
+/**
+ * \var char *manifest_path
+ * Where the manifest of the last full pass is kept, next to the
+ * configuration file.
+ *
+ * \var cfg_bool_t use_manifest
+ * If false, the manifest is neither read nor written.
+ */
+char *manifest_path;
+cfg_bool_t use_manifest = cfg_true;
+
+/**
+ * \var cfg_bool_t in_place
+ * If true, a file that exists on both sides is updated in place, writing
+ * only the blocks that differ, instead of being truncated and rewritten.
+ */
+cfg_bool_t in_place = cfg_false;
+
+/**
+ * \var cfg_bool_t use_uring
+ * If true, files are copied by <code>copy_uring()</code>, keeping
+ * several reads and writes in flight, when the kernel has io_uring.
+ *
+ * \var long queue_depth
+ * Number of blocks in flight in <code>copy_uring()</code>.
+ */
+cfg_bool_t use_uring = cfg_false;
+long queue_depth = 8;
+
+/**
+ * \var long stream_size
+ * Files of this many KiB or more are copied by <code>copy_stream()</code>,
+ * which keeps them out of the page cache. 0 turns it off.
+ *
+ * \var cfg_bool_t direct_io
+ * If true, <code>copy_stream()</code> uses <code>O_DIRECT</code> where
+ * the filesystems allow it.
+ */
+long stream_size = 64 * Kb;
+cfg_bool_t direct_io = cfg_false;
+
+/**
+ * \var long resume_size
+ * Files of this many KiB or more are copied with checkpoints, so an
+ * interrupted copy goes on where it stopped, see <code>resume_open()</code>.
+ * 0 turns it off.
+ *
+ * \var long checkpoint_size
+ * KiB copied between two checkpoints, the most an interruption can cost.
+ *
+ * \var char *journal_path
+ * Where the checkpoints are kept, next to the configuration file.
+ */
+long resume_size = 256 * Kb, checkpoint_size = 64 * Kb;
+char *journal_path;
+
+/**
+ * \var cfg_bool_t check_ctime
+ * If true, a file whose change time moved since the last manifest is
+ * checked again, even with the same size and modification time.
+ *
+ * \var cfg_bool_t check_inode
+ * If true, a file replaced by another, with a new inode, is checked
+ * again. Filesystems without stable inodes, as FAT, should turn it off.
+ */
+cfg_bool_t check_ctime = cfg_false;
+cfg_bool_t check_inode = cfg_true;
+
+/**
+ * \var long modify_window
+ * Milliseconds two modification times may differ by and still be the
+ * same, for filesystems that round them. -1 takes it from the filesystems
+ * of the pair: 2 seconds if one is FAT or exFAT, 0 otherwise.
+ *
+ * \var long long mtime_window
+ * The window of the pair being synced, in nanoseconds, set by
+ * <code>window_set()</code>.
+ */
+long modify_window = -1;
+long long mtime_window;
+
+/**
+ * \var cfg_bool_t use_plan
+ * If true, a full pass first plans everything it has to do, then does it
+ * in the order of the disk, see <code>sync_plan()</code>.
+ *
+ * \var int dry_run
+ * If true, the plan is printed and nothing is written.
+ */
+cfg_bool_t use_plan = cfg_false;
+int dry_run = 0;
+
+/**
+ * \enum durable_mode
+ * \brief When the copies are flushed to the disk.
+ */
+enum durable_mode
+{
+        DURABLE_NONE,
+        DURABLE_FILE,
+        DURABLE_BATCH
+};
+
+/**
+ * \var char *durability_name
+ * The <code>durability</code> option: none, file or batch.
+ *
+ * \var long durability
+ * One of <code>durable_mode</code>. "none" leaves it to the kernel,
+ * "file" syncs each copy before it takes the place of the old one, and
+ * "batch" syncs the filesystem once every <code>batch_files</code>
+ * copies or <code>batch_size</code> KiB, and at the end of each sync.
+ *
+ * \var long batch_files
+ * Copies of a batch, 0 for no limit.
+ *
+ * \var long batch_size
+ * KiB of a batch, 0 for no limit.
+ */
+char *durability_name;
+long durability = DURABLE_BATCH, batch_files = 1000, batch_size = 256 * 1024;
+
+/**
+ * \enum dedup_mode
+ * \brief What a new file identical to one already synced becomes.
+ */
+enum dedup_mode
+{
+        DEDUP_OFF,
+        DEDUP_REFLINK,
+        DEDUP_HARDLINK
+};
+
+/**
+ * \var char *dedup_name
+ * The <code>dedup</code> option: off, reflink or hardlink.
+ *
+ * \var long dedup_mode
+ * One of <code>dedup_mode</code>. A hard link is only made when the
+ * owner, mode and times of both files are the same, else a reflink is
+ * tried.
+ *
+ * \var char *dedup_path
+ * Where the index of <code>dedup_copy()</code> is kept, next to the
+ * configuration file.
+ */
+char *dedup_name, *dedup_path;
+long dedup_mode = DEDUP_OFF;
+
+/**
+ * \enum verify_mode
+ * \brief How the copies are checked.
+ */
+enum verify_mode
+{
+        VERIFY_OFF,
+        VERIFY_READBACK,
+        VERIFY_STORED
+};
+
+/**
+ * \var char *verify_name
+ * The <code>verify</code> option: off, readback or stored.
+ *
+ * \var long verify_mode
+ * One of <code>verify_mode</code>. Both hash the bytes as they are
+ * copied, and keep the hash in the manifest. "readback" reads each copy
+ * back from the disk, past the page cache, before it takes the place of
+ * the old one; "stored" reads the copies in sync on later passes, and
+ * copies again those that no longer match their hash.
+ */
+char *verify_name;
+long verify_mode = VERIFY_OFF;
+
+/**
+ * \var char *io_class_name
+ * The I/O scheduling class of cpusb: idle, best-effort or realtime. If
+ * not set, the one of the parent is kept.
+ *
+ * \var long io_priority
+ * Priority inside the class, from 0, the highest, to 7.
+ *
+ * \var long bandwidth_limit
+ * KiB per second the copies may move, 0 for no limit.
+ *
+ * \var long iops_limit
+ * Copy operations per second, 0 for no limit.
+ *
+ * \var long large_file
+ * KiB from which a changed file waits for the smaller ones, in the
+ * daemon. 0 keeps the order of the paths.
+ */
+char *io_class_name;
+long io_priority = 4, bandwidth_limit = 0, iops_limit = 0, large_file = 1024;
+
+/**
+ * \struct token_bucket
+ * \brief The bytes and operations the copies may still use.
+ * Both are refilled at the configured rate, up to a second worth. A copy
+ * takes what it needs even if the bucket goes below zero, then sleeps
+ * until the debt is paid, so the threads are served in the order they
+ * came.
+ */
+struct token_bucket
+{
+        pthread_mutex_t lock;
+        double bytes;
+        double ops;
+        long long last;
+};
+
+/**
+ * \struct dedup_entry
+ * \brief A file of the source tree, by size. <code>digest</code> is the
+ * XXH64 of its contents, 0 until someone needs it; <code>mtime</code>
+ * tells if it is still good. A <code>size</code> of -1 marks an entry
+ * gone stale.
+ */
+struct dedup_entry
+{
+        int64_t size;
+        int64_t mtime;
+        uint64_t digest;
+        char *path;
+};
+
+/**
+ * \struct dedup_index
+ * \brief The files of the source tree known to <code>dedup_copy()</code>.
+ * Open addressing hash table, by size, so the files of a size are found
+ * together. <code>root_fd</code> is the top of the source tree while a
+ * sync runs, -1 otherwise.
+ */
+struct dedup_index
+{
+        pthread_mutex_t lock;
+        int loaded, changed, root_fd;
+        size_t size, used;
+        struct dedup_entry *slots;
+};
+
+/**
+ * \struct sync_pair
+ * \brief A device directory and the source directory it is synced to,
+ * with the options that may change from one pair to another.
+ * <code>name</code> is the title of its <code>sync</code> section, NULL
+ * for the pair given at the top of the configuration file.
+ */
+struct sync_pair
+{
+        char *name;
+        char *dev_path, *src_path, *manifest_path, *dedup_path, *journal_path;
+        char *device_uuid, *device_label;
+        long quiet_window, max_latency, large_file;
+        long bandwidth_limit, iops_limit;
+        cfg_bool_t in_place, use_plan;
+        struct token_bucket bucket;
+        struct dedup_index dedup;
+};
+
+/**
+ * \var struct sync_pair *pairs
+ * The pairs of the configuration file, <code>pair_count</code> of them.
+ * The globals above hold the options of the pair being synced, set by
+ * <code>pair_use()</code>.
+ *
+ * \var struct token_bucket *bucket
+ * The bucket of the pair being synced.
+ *
+ * \var struct dedup_index *dedup
+ * The index of the pair being synced.
+ */
+struct sync_pair *pairs;
+int pair_count;
+struct token_bucket *bucket;
+struct dedup_index *dedup;
+
+/**
+ * \var char *control_path
+ * The Unix socket where the daemon answers with its metrics, next to the
+ * configuration file unless <code>control_socket</code> says otherwise.
+ */
+char *control_path;
+
+/**
+ * \enum log_level
+ * \brief How much a message matters, the lower the more.
+ */
+enum log_level
+{
+        LVL_ERROR,
+        LVL_WARN,
+        LVL_INFO,
+        LVL_DEBUG
+};
+
+/**
+ * \var char *log_path
+ * The log file, <code>LOG_PATH</code>/cpusb unless <code>log_file</code>
+ * says otherwise. Messages are appended.
+ *
+ * \var char *log_level_name
+ * The <code>log_level</code> option: error, warn, info or debug.
+ *
+ * \var long log_level
+ * Messages above this level are not logged.
+ *
+ * \var long log_max_size
+ * Bytes of the log file before it is rotated, 0 never rotates.
+ *
+ * \var long log_keep
+ * Rotated files kept, as <code>log_path</code>.1 and so on.
+ *
+ * \var long log_rate
+ * Times the same error is logged in a second, the others are counted and
+ * logged as a single line. 0 logs all.
+ */
+char *log_path, *log_level_name;
+long log_level = LVL_INFO, log_max_size = 4 * 1024 * Kb, log_keep = 3, log_rate = 10;
+
 #endif
 
 /**
- * \brief prints mensages for non-critical errors.
- * \param msg String to be printed.
- * \param err contains <code>errno</code>.
- * \see errno.h
+ * \def HIST_SUB_BITS
+ * Each power of two of a <code>histogram</code> is split in
+ * 2^<code>HIST_SUB_BITS</code> buckets, so a value is known within 1/16.
  */
-void
-report (const char *msg, const int err)
-{       
-        char *cwd;
-        FILE *log_file;
+#define HIST_SUB_BITS 4
+
+/**
+ * \def HIST_SUB
+ * Buckets per power of two.
+ */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/**
+ * \def HIST_BUCKETS
+ * Buckets enough for any 64 bits value.
+ */
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/**
+ * \struct histogram
+ * \brief Distribution of a duration, in microseconds.
+ * Log-linear buckets, as HDR histograms: exact below <code>HIST_SUB</code>,
+ * then <code>HIST_SUB</code> buckets for each power of two. Every field is
+ * updated with atomic adds, so any thread records without a lock.
+ */
+struct histogram
+{
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+        uint64_t buckets[HIST_BUCKETS];
+};
+
+/**
+ * \struct metrics
+ * \brief What cpusb did since it started.
+ * The counters only grow, so a reader gets rates from two samples.
+ * <code>bytes_deduped</code> is what <code>dedup_copy()</code> didn't
+ * have to copy, <code>bytes_resumed</code> what the copies resumed from a
+ * checkpoint didn't copy again, <code>verify_failures</code> the copies
+ * that didn't match their hash. <code>queued</code> is the tasks and
+ * changed paths still waiting, and <code>pending_since</code> the time of
+ * the oldest change not synced yet, 0 if none.
+ */
+struct metrics
+{
+        long long started;
+        uint64_t files_copied;
+        uint64_t bytes_copied;
+        uint64_t bytes_deduped;
+        uint64_t bytes_resumed;
+        uint64_t verify_failures;
+        uint64_t errors;
+        int64_t queued;
+        long long pending_since;
+        struct histogram scan_time;
+        struct histogram copy_time;
+        struct histogram event_latency;
+};
 
-        cwd = getcwd (NULL, 0);
-        chdir (LOG_PATH);
+/**
+ * \var struct metrics metrics
+ * The metrics of this process.
+ */
+struct metrics metrics;
 
-        log_file = fopen ("cpusb", "w");
+/**
+ * \var volatile sig_atomic_t dump_asked
+ * Set by SIGUSR1, the daemon then writes the metrics to the log directory.
+ */
+volatile sig_atomic_t dump_asked;
 
-        fprintf (log_file, "cpusb: %s.\ncpusb: %s\n", msg, strerror (err));
+/**
+ * \brief Microseconds of the monotonic clock.
+ */
+long long
+now_us ()
+{
+        struct timespec ts;
 
-        fclose (log_file);
+        clock_gettime (CLOCK_MONOTONIC, &ts);
 
-        /* This function don't change the current directory. */
-        chdir (cwd);
+        return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
 }
 
 /**
- * \brief Print error message and exit the program.
- * For error that can't be handled, fatal is call for prints the message and
- * close the program.
- *
- * \param msg String to be printed.
- * \param err contains <code>errno</code>.
+ * \brief Bucket of <code>value</code> in a <code>histogram</code>.
+ */
+int
+hist_bucket (uint64_t value)
+{
+        int exp;
+
+        if (value < HIST_SUB)
+                return value;
+
+        exp = 63 - __builtin_clzll (value);
+
+        return (exp - HIST_SUB_BITS + 1) * HIST_SUB + ((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/**
+ * \brief Lowest value that falls in <code>bucket</code>.
+ */
+uint64_t
+hist_floor (int bucket)
+{
+        int exp;
+
+        if (bucket < HIST_SUB)
+                return bucket;
+
+        exp = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+
+        return (uint64_t) (HIST_SUB + bucket % HIST_SUB) << (exp - HIST_SUB_BITS);
+}
+
+/**
+ * \brief Adds one <code>value</code> to <code>hist</code>.
  */
 void
-fatal (const char *msg, const int err)
+hist_record (struct histogram *hist, long long value)
 {
-        report (msg, err);
-        exit (EXIT_FAILURE);
+        uint64_t v = value > 0 ? value : 0, max;
+
+        __atomic_add_fetch (&hist->buckets[hist_bucket (v)], 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&hist->count, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch (&hist->sum, v, __ATOMIC_RELAXED);
+
+        max = __atomic_load_n (&hist->max, __ATOMIC_RELAXED);
+        while (v > max && !__atomic_compare_exchange_n (&hist->max, &max, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
 }
 
 /**
- * Change the current directory, make it if no exist.
- * Some functions needs to change the current directory,
- * <code>cwdir</code> turns it more flexible and centralized.
- * If the destination directory no exist, is created.
+ * \brief Value below which <code>q</code> of the records of <code>hist</code> are.
+ * The answer is the floor of the bucket, never above the maximum seen.
  *
- * \param dir_cur the base directory.
- * \param dir the target, can be created.
- * \return <code>dir</code>, the target directory.
+ * \param q Between 0 and 1.
+ */
+uint64_t
+hist_quantile (const struct histogram *hist, double q)
+{
+        int i;
+        uint64_t count, seen = 0, rank, max;
+
+        count = __atomic_load_n (&hist->count, __ATOMIC_RELAXED);
+        max = __atomic_load_n (&hist->max, __ATOMIC_RELAXED);
+        if (count == 0)
+                return 0;
+
+        rank = q * count;
+        if (rank < 1)
+                rank = 1;
+        for (i = 0; i < HIST_BUCKETS; i++)
+        {
+                seen += __atomic_load_n (&hist->buckets[i], __ATOMIC_RELAXED);
+                if (seen >= rank)
+                        return hist_floor (i) < max ? hist_floor (i) : max;
+        }
+
+        return max;
+}
+
+/**
+ * \brief Writes one <code>hist</code> named <code>name</code> to <code>out</code>.
+ */
+void
+hist_dump (FILE *out, const char *name, const struct histogram *hist, int json)
+{
+        uint64_t count = __atomic_load_n (&hist->count, __ATOMIC_RELAXED);
+        uint64_t sum = __atomic_load_n (&hist->sum, __ATOMIC_RELAXED);
+
+        fprintf (out, json ? ",\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}"
+                           : "%s count=%llu mean=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+                 name, (unsigned long long) count, (unsigned long long) (count ? sum / count : 0),
+                 (unsigned long long) hist_quantile (hist, 0.50),
+                 (unsigned long long) hist_quantile (hist, 0.90),
+                 (unsigned long long) hist_quantile (hist, 0.99),
+                 (unsigned long long) __atomic_load_n (&hist->max, __ATOMIC_RELAXED));
+}
+
+/**
+ * \brief Writes <code>metrics</code> to <code>out</code>, as text or JSON.
+ * Text gives one metric per line, "name value", JSON one object. The
+ * durations are in microseconds.
+ */
+void
+metrics_dump (FILE *out, int json)
+{
+        long long now = now_us (), since;
+        long long uptime = now - metrics.started;
+        uint64_t bytes = __atomic_load_n (&metrics.bytes_copied, __ATOMIC_RELAXED);
+
+        since = __atomic_load_n (&metrics.pending_since, __ATOMIC_RELAXED);
+        fprintf (out, json ? "{\"uptime_sec\":%lld,\"files_copied\":%llu,\"bytes_copied\":%llu,\"bytes_deduped\":%llu,"
+                             "\"bytes_resumed\":%llu,\"verify_failures\":%llu,\"bytes_per_sec\":%llu,\"errors\":%llu,\"queued\":%lld,\"sync_lag_ms\":%lld"
+                           : "uptime_sec %lld\nfiles_copied %llu\nbytes_copied %llu\nbytes_deduped %llu\n"
+                             "bytes_resumed %llu\nverify_failures %llu\nbytes_per_sec %llu\nerrors %llu\nqueued %lld\nsync_lag_ms %lld\n",
+                 uptime / 1000000,
+                 (unsigned long long) __atomic_load_n (&metrics.files_copied, __ATOMIC_RELAXED),
+                 (unsigned long long) bytes,
+                 (unsigned long long) __atomic_load_n (&metrics.bytes_deduped, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n (&metrics.bytes_resumed, __ATOMIC_RELAXED),
+                 (unsigned long long) __atomic_load_n (&metrics.verify_failures, __ATOMIC_RELAXED),
+                 (unsigned long long) (uptime > 0 ? bytes * 1000000.0 / uptime : 0),
+                 (unsigned long long) __atomic_load_n (&metrics.errors, __ATOMIC_RELAXED),
+                 (long long) __atomic_load_n (&metrics.queued, __ATOMIC_RELAXED),
+                 since ? (now - since) / 1000 : 0);
+        hist_dump (out, "scan_time_us", &metrics.scan_time, json);
+        hist_dump (out, "copy_time_us", &metrics.copy_time, json);
+        hist_dump (out, "event_latency_us", &metrics.event_latency, json);
+        if (json)
+                fprintf (out, "}\n");
+}
+
+/**
+ * \brief Writes all of <code>buf</code> to <code>fd</code>.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+write_all (int fd, const void *buf, size_t len)
+{
+        const char *p = buf;
+        ssize_t wr;
+
+        while (len)
+        {
+                wr = write (fd, p, len);
+                if (wr < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                p += wr;
+                len -= wr;
+        }
+
+        return 0;
+}
+
+/**
+ * \struct log_slot
+ * \brief A message waiting in the log ring.
+ * <code>seq</code> tells the state of the slot for the round
+ * <code>r</code> of the ring: 2r is free, 2r + 1 holds a message.
+ */
+struct log_slot
+{
+        uint64_t seq;
+        int level;
+        int err;
+        struct timespec when;
+        char msg[LOG_LINE];
+};
+
+/**
+ * \struct log_rate
+ * \brief How many times an error, by hash, was logged in
+ * <code>second</code>, and how many were dropped.
+ */
+struct log_rate
+{
+        uint64_t hash;
+        long long second;
+        uint32_t count;
+        uint32_t dropped;
+};
+
+/**
+ * \struct log_ring
+ * \brief The messages on their way to the log file.
+ * Any thread puts messages at <code>head</code> without a lock, claiming
+ * a slot with a compare and swap, and only the thread holding
+ * <code>lock</code> takes them from <code>tail</code>. That is the writer
+ * thread, started by the first message, or whoever calls
+ * <code>log_flush()</code>.
+ */
+struct log_ring
+{
+        uint64_t head;
+        uint64_t tail;
+        uint64_t lost;
+        int started;
+        int sleeping;
+        int fd;
+        off_t size;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct log_slot slots[LOG_SLOTS];
+        struct log_rate rate[LOG_RATE_SLOTS];
+};
+
+/**
+ * \var struct log_ring log_ring
+ * The log of this process.
+ */
+struct log_ring log_ring = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/**
+ * \var const char *log_names
+ * Names of the levels, as in the <code>log_level</code> option.
+ */
+const char *log_names[] = {"error", "warn", "info", "debug", NULL};
+
+/**
+ * \brief Opens <code>log_path</code> for appending, if it isn't open.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+log_open ()
+{
+        struct stat sb;
+
+        if (log_ring.fd >= 0)
+                return 0;
+
+        log_ring.fd = open (log_path ? log_path : LOG_PATH "/cpusb",
+                            O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+        if (log_ring.fd < 0)
+                return -1;
+        log_ring.size = fstat (log_ring.fd, &sb) ? 0 : sb.st_size;
+
+        return 0;
+}
+
+/**
+ * \brief Rotates the log file, keeping <code>log_keep</code> old ones.
+ * The log is renamed to .1, .1 to .2 and so on; the oldest is lost.
+ */
+void
+log_rotate ()
+{
+        char from[PATH_MAX], to[PATH_MAX];
+        const char *path = log_path ? log_path : LOG_PATH "/cpusb";
+        long i;
+
+        close (log_ring.fd);
+        log_ring.fd = -1;
+
+        for (i = log_keep; i > 0; i--)
+        {
+                if (i > 1)
+                        snprintf (from, PATH_MAX, "%s.%ld", path, i - 1);
+                else
+                        snprintf (from, PATH_MAX, "%s", path);
+                snprintf (to, PATH_MAX, "%s.%ld", path, i);
+                rename (from, to);
+        }
+        if (log_keep <= 0)
+                unlink (path);
+
+        log_open ();
+}
+
+/**
+ * \brief Formats one line of the log in <code>buf</code>.
+ * \return The length of the line.
+ */
+int
+log_format (char *buf, size_t size, int level, int err, const struct timespec *when, const char *msg)
+{
+        char date[32], errbuf[128];
+        int len;
+        struct tm tm;
+
+        localtime_r (&when->tv_sec, &tm);
+        strftime (date, sizeof (date), "%Y-%m-%d %H:%M:%S", &tm);
+
+        /* Without errno, the message is just a notice. */
+        if (err)
+                len = snprintf (buf, size, "%s.%03ld cpusb %s: %s: %s\n", date, when->tv_nsec / 1000000,
+                                log_names[level], msg, strerror_r (err, errbuf, sizeof (errbuf)));
+        else
+                len = snprintf (buf, size, "%s.%03ld cpusb %s: %s\n", date, when->tv_nsec / 1000000,
+                                log_names[level], msg);
+
+        return len < (int) size ? len : (int) size - 1;
+}
+
+/**
+ * \brief Writes <code>len</code> bytes of <code>buf</code> to the log file,
+ * rotating it when it grows past <code>log_max_size</code>.
+ */
+void
+log_write (const char *buf, size_t len)
+{
+        if (len == 0 || log_open ())
+                return;
+
+        if (write_all (log_ring.fd, buf, len) == 0)
+                log_ring.size += len;
+        if (log_max_size > 0 && log_ring.size >= log_max_size)
+                log_rotate ();
+}
+
+/**
+ * \brief Writes everything in the ring to the log file.
+ * Must be called with <code>log_ring.lock</code> held. The lines are
+ * gathered so a burst of messages costs few writes.
+ *
+ * \param all If true, the errors held back in the current second are
+ * also counted, as the process is ending.
+ * \return 1 if something was written.
+ */
+int
+log_drain (int all)
+{
+        char buf[16 * Kb], note[MAX_INPUT];
+        size_t len = 0;
+        uint32_t dropped;
+        uint64_t pos, lost, round;
+        int i, any = 0;
+        long long second;
+        struct log_slot *slot;
+        struct timespec now;
+
+        clock_gettime (CLOCK_REALTIME_COARSE, &now);
+
+        for (;;)
+        {
+                pos = log_ring.tail;
+                slot = &log_ring.slots[pos & (LOG_SLOTS - 1)];
+                round = pos / LOG_SLOTS;
+                if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != 2 * round + 1)
+                        break;
+
+                if (len + LOG_LINE + 256 > sizeof (buf))
+                {
+                        log_write (buf, len);
+                        len = 0;
+                }
+                len += log_format (buf + len, sizeof (buf) - len, slot->level, slot->err, &slot->when, slot->msg);
+
+                __atomic_store_n (&slot->seq, 2 * round + 2, __ATOMIC_RELEASE);
+                log_ring.tail = pos + 1;
+                any = 1;
+        }
+
+        /* What the rate limit held back, once its second is over. */
+        second = now.tv_sec;
+        for (i = 0; i < LOG_RATE_SLOTS; i++)
+                if ((all || __atomic_load_n (&log_ring.rate[i].second, __ATOMIC_RELAXED) < second) &&
+                    (dropped = __atomic_exchange_n (&log_ring.rate[i].dropped, 0, __ATOMIC_RELAXED)))
+                {
+                        if (len + 256 > sizeof (buf))
+                        {
+                                log_write (buf, len);
+                                len = 0;
+                        }
+                        snprintf (note, MAX_INPUT, "%u repeated errors were not logged", dropped);
+                        len += log_format (buf + len, sizeof (buf) - len, LVL_WARN, 0, &now, note);
+                }
+
+        if ((lost = __atomic_exchange_n (&log_ring.lost, 0, __ATOMIC_RELAXED)))
+        {
+                if (len + 256 > sizeof (buf))
+                {
+                        log_write (buf, len);
+                        len = 0;
+                }
+                snprintf (note, MAX_INPUT, "%llu messages lost, the log ring was full", (unsigned long long) lost);
+                len += log_format (buf + len, sizeof (buf) - len, LVL_WARN, 0, &now, note);
+        }
+
+        log_write (buf, len);
+
+        return any;
+}
+
+/**
+ * \brief Writes the messages in the ring, until the process ends.
+ * Sleeps when the ring is empty, woken by new messages or after 100
+ * milliseconds, to catch up with the rate limit.
+ */
+void *
+log_work (void *arg)
+{
+        struct timespec ts;
+
+        (void) arg;
+        pthread_mutex_lock (&log_ring.lock);
+        for (;;)
+        {
+                if (log_drain (0))
+                        continue;
+
+                clock_gettime (CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 100000000;
+                if (ts.tv_nsec >= 1000000000)
+                {
+                        ts.tv_sec++;
+                        ts.tv_nsec -= 1000000000;
+                }
+                __atomic_store_n (&log_ring.sleeping, 1, __ATOMIC_RELEASE);
+                pthread_cond_timedwait (&log_ring.cond, &log_ring.lock, &ts);
+                __atomic_store_n (&log_ring.sleeping, 0, __ATOMIC_RELEASE);
+        }
+
+        return NULL;
+}
+
+/**
+ * \brief Writes what is still in the ring, before the process ends.
+ */
+void
+log_flush ()
+{
+        pthread_mutex_lock (&log_ring.lock);
+        log_drain (1);
+        pthread_mutex_unlock (&log_ring.lock);
+}
+
+/**
+ * \brief Writes what is in the ring and closes the log file, so the next
+ * messages go to the current <code>log_path</code>.
+ */
+void
+log_reopen ()
+{
+        pthread_mutex_lock (&log_ring.lock);
+        log_drain (0);
+        if (log_ring.fd >= 0)
+                close (log_ring.fd);
+        log_ring.fd = -1;
+        pthread_mutex_unlock (&log_ring.lock);
+}
+
+/**
+ * \brief Holds the ring across <code>fork()</code>.
+ */
+void
+log_prepare ()
+{
+        pthread_mutex_lock (&log_ring.lock);
+}
+
+/**
+ * \brief Releases the ring after <code>fork()</code>, in the parent.
+ */
+void
+log_parent ()
+{
+        pthread_mutex_unlock (&log_ring.lock);
+}
+
+/**
+ * \brief Releases the ring after <code>fork()</code>, in the child.
+ * The writer thread didn't survive, the next message starts another.
+ */
+void
+log_child ()
+{
+        log_ring.started = 0;
+        log_ring.sleeping = 0;
+        pthread_mutex_unlock (&log_ring.lock);
+}
+
+/**
+ * \brief Starts the writer thread, if it isn't running.
+ * If it can't start, the messages are written by whoever logs.
+ */
+void
+log_start ()
+{
+        static int once;
+
+        pthread_mutex_lock (&log_ring.lock);
+        if (!log_ring.started)
+        {
+                if (!once)
+                {
+                        pthread_atfork (log_prepare, log_parent, log_child);
+                        atexit (log_flush);
+                        once = 1;
+                }
+                if (pthread_create (&log_ring.thread, NULL, log_work, NULL))
+                        __atomic_store_n (&log_ring.started, -1, __ATOMIC_RELEASE);
+                else
+                {
+                        pthread_detach (log_ring.thread);
+                        __atomic_store_n (&log_ring.started, 1, __ATOMIC_RELEASE);
+                }
+        }
+        pthread_mutex_unlock (&log_ring.lock);
+}
+
+/**
+ * \brief Tells if an error must be held back by the rate limit.
+ * Counts the messages of each second, by hash of the text. Two threads
+ * starting a second at once may let a message or two more pass, which is
+ * fine for a limit.
+ */
+int
+log_limited (const char *msg, long long second)
+{
+        uint64_t hash = 14695981039346656037ULL;
+        const unsigned char *p;
+        struct log_rate *rate;
+
+        if (log_rate <= 0)
+                return 0;
+
+        for (p = (const unsigned char *) msg; *p; p++)
+                hash = (hash ^ *p) * 1099511628211ULL;
+        rate = &log_ring.rate[hash & (LOG_RATE_SLOTS - 1)];
+
+        if (__atomic_load_n (&rate->hash, __ATOMIC_RELAXED) != hash ||
+            __atomic_load_n (&rate->second, __ATOMIC_RELAXED) != second)
+        {
+                __atomic_store_n (&rate->count, 0, __ATOMIC_RELAXED);
+                __atomic_store_n (&rate->hash, hash, __ATOMIC_RELAXED);
+                __atomic_store_n (&rate->second, second, __ATOMIC_RELAXED);
+        }
+
+        if (__atomic_add_fetch (&rate->count, 1, __ATOMIC_RELAXED) <= (uint32_t) log_rate)
+                return 0;
+        __atomic_add_fetch (&rate->dropped, 1, __ATOMIC_RELAXED);
+
+        return 1;
+}
+
+/**
+ * \brief Puts a message in the log ring.
+ * Costs a clock read, a compare and swap and a copy of the message: the
+ * file is written by the writer thread.
+ *
+ * \param level One of <code>log_level</code>.
+ * \param msg The message.
+ * \param err contains <code>errno</code>, 0 for none.
+ */
+void
+log_msg (int level, const char *msg, int err)
+{
+        uint64_t pos, seq, round;
+        struct log_slot *slot;
+        struct timespec when;
+
+        if (level > log_level)
+                return;
+
+        clock_gettime (CLOCK_REALTIME_COARSE, &when);
+        if (err && log_limited (msg, when.tv_sec))
+                return;
+
+        if (__atomic_load_n (&log_ring.started, __ATOMIC_ACQUIRE) == 0)
+                log_start ();
+
+        pos = __atomic_load_n (&log_ring.head, __ATOMIC_RELAXED);
+        for (;;)
+        {
+                slot = &log_ring.slots[pos & (LOG_SLOTS - 1)];
+                round = pos / LOG_SLOTS;
+                seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+                if (seq == 2 * round)
+                {
+                        if (__atomic_compare_exchange_n (&log_ring.head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                                break;
+                }
+                else if (seq < 2 * round)
+                {
+                        /* Full, the writer is behind. */
+                        __atomic_add_fetch (&log_ring.lost, 1, __ATOMIC_RELAXED);
+                        return;
+                }
+                else
+                        pos = __atomic_load_n (&log_ring.head, __ATOMIC_RELAXED);
+        }
+
+        slot->level = level;
+        slot->err = err;
+        slot->when = when;
+        strncpy (slot->msg, msg, LOG_LINE - 1);
+        slot->msg[LOG_LINE - 1] = '\0';
+        __atomic_store_n (&slot->seq, 2 * round + 1, __ATOMIC_RELEASE);
+
+        /* No writer thread, the caller writes. */
+        if (__atomic_load_n (&log_ring.started, __ATOMIC_ACQUIRE) < 0)
+        {
+                pthread_mutex_lock (&log_ring.lock);
+                log_drain (0);
+                pthread_mutex_unlock (&log_ring.lock);
+        }
+        else if (__atomic_load_n (&log_ring.sleeping, __ATOMIC_ACQUIRE))
+                pthread_cond_signal (&log_ring.cond);
+}
+
+/**
+ * \brief prints mensages for non-critical errors.
+ * A message with <code>err</code> is an error, without it a notice.
+ *
+ * \param msg String to be printed.
+ * \param err contains <code>errno</code>.
+ * \see errno.h
+ */
+void
+report (const char *msg, const int err)
+{
+        if (err)
+                __atomic_add_fetch (&metrics.errors, 1, __ATOMIC_RELAXED);
+
+        log_msg (err ? LVL_ERROR : LVL_INFO, msg, err);
+}
+
+/**
+ * \brief Print error message and exit the program.
+ * For error that can't be handled, fatal is call for prints the message and
+ * close the program.
+ *
+ * \param msg String to be printed.
+ * \param err contains <code>errno</code>.
+ */
+void
+fatal (const char *msg, const int err)
+{
+        report (msg, err);
+        exit (EXIT_FAILURE);
+}
+
+/**
+ * \def DIR_MODE
+ * Permissions of the directories created before knowing the original ones.
+ */
+#define DIR_MODE (S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH)
+
+/**
+ * \brief Open a directory, make it if no exist.
+ * Nothing in cpusb changes the current directory, every path is resolved
+ * relative to an open directory. <code>open_dir</code> turns it more
+ * flexible and centralized.
+ * If the target directory no exist, is created.
+ *
+ * \param dir_fd the base directory, or <code>AT_FDCWD</code>.
+ * \param dir the target, can be created.
+ * \param mode permissions of <code>dir</code>, if created.
+ * \param owner owner of <code>dir</code>, if created.
+ * \param group group of <code>dir</code>, if created.
+ * \return file descriptor of <code>dir</code>, -1 on error.
+ */
+int
+open_dir (int dir_fd, const char *dir, mode_t mode, uid_t owner, gid_t group)
+{
+        char msg[MAX_INPUT];
+        int fd;
+
+        fd = openat (dir_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 && errno == ENOENT)
+        {
+                if (mkdirat (dir_fd, dir, DIR_MODE))
+                {
+                        snprintf (msg, MAX_INPUT, "%s doesn't exist. Can't make it", dir);
+                        report (msg, errno);
+                        return -1;
+                }
+
+                /* Ownership first, chown may clear the set-id bits. */
+                if (fchownat (dir_fd, dir, owner, group, AT_SYMLINK_NOFOLLOW) && errno != EPERM)
+                        report ("This error can't be handled", errno);
+                fchmodat (dir_fd, dir, mode, 0);
+
+                fd = openat (dir_fd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+
+        if (fd < 0)
+        {
+                snprintf (msg, MAX_INPUT, "Can't access %s", dir);
+                report (msg, errno);
+        }
+
+        return fd;
+}
+
+/**
+ * \brief Writes <code>dir</code>/<code>name</code> in <code>buf</code>.
+ * An empty <code>dir</code> gives just <code>name</code>.
+ *
+ * \return 0 on success, -1 if it doesn't fit in <code>PATH_MAX</code>.
+ */
+int
+join_path (char *buf, const char *dir, const char *name)
+{
+        int len;
+
+        if (*dir)
+                len = snprintf (buf, PATH_MAX, "%s/%s", dir, name);
+        else
+                len = snprintf (buf, PATH_MAX, "%s", name);
+
+        return (len < 0 || len >= PATH_MAX) ? -1 : 0;
+}
+
+/**
+ * \brief Adds a pair to <code>pairs</code>. Its options are the ones the
+ * globals hold now, those at the top of the configuration file.
+ *
+ * \param name Title of its <code>sync</code> section, NULL for none.
+ * \return The new pair.
+ */
+struct sync_pair *
+pair_add (const char *name)
+{
+        struct sync_pair *pair;
+
+        pair = realloc (pairs, (pair_count + 1) * sizeof (struct sync_pair));
+        if (pair == NULL)
+                fatal ("Can't allocate the sync pairs", errno);
+        pairs = pair;
+        pair = &pairs[pair_count++];
+        memset (pair, 0, sizeof (struct sync_pair));
+
+        pair->name = name ? strdup (name) : NULL;
+        pair->dev_path = dev_path ? strdup (dev_path) : NULL;
+        pair->src_path = src_path ? strdup (src_path) : NULL;
+        pair->device_uuid = device_uuid ? strdup (device_uuid) : NULL;
+        pair->device_label = device_label ? strdup (device_label) : NULL;
+        pair->manifest_path = manifest_path ? strdup (manifest_path) : NULL;
+        pair->dedup_path = dedup_path ? strdup (dedup_path) : NULL;
+        pair->journal_path = journal_path ? strdup (journal_path) : NULL;
+        pair->quiet_window = quiet_window;
+        pair->max_latency = max_latency;
+        pair->large_file = large_file;
+        pair->bandwidth_limit = bandwidth_limit;
+        pair->iops_limit = iops_limit;
+        pair->in_place = in_place;
+        pair->use_plan = use_plan;
+        pthread_mutex_init (&pair->bucket.lock, NULL);
+        pthread_mutex_init (&pair->dedup.lock, NULL);
+        pair->dedup.root_fd = -1;
+
+        return pair;
+}
+
+/**
+ * \brief Sets the options of <code>pair</code> given in its section
+ * <code>sec</code>. Its manifest, dedup index and journal are named
+ * after it.
+ *
+ * \param conf_path Directory of the configuration file.
+ */
+void
+pair_read (struct sync_pair *pair, cfg_t *sec, const char *conf_path)
+{
+        if (cfg_size (sec, "device_path"))
+        {
+                free (pair->dev_path);
+                pair->dev_path = strdup (cfg_getstr (sec, "device_path"));
+        }
+        if (cfg_size (sec, "source_path"))
+        {
+                free (pair->src_path);
+                pair->src_path = strdup (cfg_getstr (sec, "source_path"));
+        }
+        if (cfg_size (sec, "device_uuid"))
+        {
+                free (pair->device_uuid);
+                pair->device_uuid = strdup (cfg_getstr (sec, "device_uuid"));
+        }
+        if (cfg_size (sec, "device_label"))
+        {
+                free (pair->device_label);
+                pair->device_label = strdup (cfg_getstr (sec, "device_label"));
+        }
+        if (cfg_size (sec, "quiet_window"))
+                pair->quiet_window = cfg_getint (sec, "quiet_window");
+        if (cfg_size (sec, "max_latency"))
+                pair->max_latency = cfg_getint (sec, "max_latency");
+        if (cfg_size (sec, "large_file"))
+                pair->large_file = cfg_getint (sec, "large_file");
+        if (cfg_size (sec, "bandwidth_limit"))
+                pair->bandwidth_limit = cfg_getint (sec, "bandwidth_limit");
+        if (cfg_size (sec, "iops_limit"))
+                pair->iops_limit = cfg_getint (sec, "iops_limit");
+        if (cfg_size (sec, "in_place"))
+                pair->in_place = cfg_getbool (sec, "in_place");
+        if (cfg_size (sec, "plan"))
+                pair->use_plan = cfg_getbool (sec, "plan");
+
+        free (pair->manifest_path);
+        pair->manifest_path = malloc (PATH_MAX);
+        if (pair->manifest_path)
+                snprintf (pair->manifest_path, PATH_MAX, "%s/.cpusb.%s.manifest", conf_path, pair->name);
+        free (pair->dedup_path);
+        pair->dedup_path = malloc (PATH_MAX);
+        if (pair->dedup_path)
+                snprintf (pair->dedup_path, PATH_MAX, "%s/.cpusb.%s.dedup", conf_path, pair->name);
+        free (pair->journal_path);
+        pair->journal_path = malloc (PATH_MAX);
+        if (pair->journal_path)
+                snprintf (pair->journal_path, PATH_MAX, "%s/.cpusb.%s.journal", conf_path, pair->name);
+}
+
+/**
+ * \brief Makes <code>pair</code> the one being synced: the globals take
+ * its options.
+ */
+void
+pair_use (struct sync_pair *pair)
+{
+        dev_path = pair->dev_path;
+        src_path = pair->src_path;
+        device_uuid = pair->device_uuid;
+        device_label = pair->device_label;
+        manifest_path = pair->manifest_path;
+        dedup_path = pair->dedup_path;
+        journal_path = pair->journal_path;
+        quiet_window = pair->quiet_window;
+        max_latency = pair->max_latency;
+        large_file = pair->large_file;
+        bandwidth_limit = pair->bandwidth_limit;
+        iops_limit = pair->iops_limit;
+        in_place = pair->in_place;
+        use_plan = pair->use_plan;
+        bucket = &pair->bucket;
+        dedup = &pair->dedup;
+        sync_stop = 0;
+}
+
+/**
+ * \brief Writes <code>label</code> as udev names it in
+ * <code>/dev/disk/by-label</code>: the bytes other than letters, digits,
+ * "#+-.:=@_" and those of UTF-8 become <code>\\xNN</code>.
+ */
+void
+mount_label (const char *label, char *out, size_t size)
+{
+        size_t len = 0;
+        const unsigned char *p;
+
+        for (p = (const unsigned char *) label; *p && len + 5 < size; p++)
+                if ((*p >= '0' && *p <= '9') || (*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z') ||
+                    *p >= 0x80 || strchr ("#+-.:=@_", *p))
+                        out[len++] = *p;
+                else
+                        len += snprintf (out + len, size - len, "\\x%02x", *p);
+        out[len] = '\0';
+}
+
+/**
+ * \brief Undoes, in place, the octal escapes of the paths of
+ * <code>/proc/self/mountinfo</code>, as <code>\\040</code> for a space.
+ */
+void
+mount_unescape (char *path)
+{
+        char *in, *out;
+
+        for (in = out = path; *in; out++)
+                if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7' &&
+                    in[3] >= '0' && in[3] <= '7')
+                {
+                        *out = (in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0');
+                        in += 4;
+                }
+                else
+                        *out = *in++;
+        *out = '\0';
+}
+
+/**
+ * \brief Finds where the filesystem of <code>uuid</code>, or else of
+ * <code>label</code>, is mounted. Its name in <code>/dev/disk</code>
+ * gives the device number, which is looked for in
+ * <code>/proc/self/mountinfo</code>. Only a mount of the whole
+ * filesystem counts, not a bind mount of a directory inside.
+ *
+ * \param uuid UUID of the filesystem, NULL to go by the label.
+ * \param label Label of the filesystem.
+ * \param mount Gets the mount point, <code>PATH_MAX</code> bytes.
+ * \return 0 if mounted, -1 otherwise.
+ */
+int
+mount_find (const char *uuid, const char *label, char *mount)
+{
+        char path[PATH_MAX], name[NAME_MAX + 1], root[PATH_MAX], source[PATH_MAX], *line = NULL, *sep;
+        int ret = -1;
+        unsigned int major, minor;
+        size_t alloc = 0;
+        dev_t rdev;
+        FILE *file;
+        struct stat sb;
+
+        if (uuid)
+                snprintf (path, PATH_MAX, "/dev/disk/by-uuid/%s", uuid);
+        else if (label)
+        {
+                mount_label (label, name, sizeof (name));
+                snprintf (path, PATH_MAX, "/dev/disk/by-label/%s", name);
+        }
+        else
+                return -1;
+        if (stat (path, &sb) || !S_ISBLK (sb.st_mode))
+                return -1;
+        rdev = sb.st_rdev;
+
+        file = fopen ("/proc/self/mountinfo", "r");
+        if (file == NULL)
+                return -1;
+        while (ret && getline (&line, &alloc, file) > 0)
+        {
+                if (sscanf (line, "%*d %*d %u:%u %4095s %4095s", &major, &minor, root, mount) != 4 || strcmp (root, "/"))
+                        continue;
+                /* Btrfs and others show a number of their own, the source is the device. */
+                sep = strstr (line, " - ");
+                if (makedev (major, minor) == rdev ||
+                    (major == 0 && sep && sscanf (sep + 3, "%*s %4095s", source) == 1 && source[0] == '/' &&
+                     !stat (source, &sb) && S_ISBLK (sb.st_mode) && sb.st_rdev == rdev))
+                {
+                        mount_unescape (mount);
+                        ret = 0;
+                }
+        }
+        free (line);
+        fclose (file);
+
+        return ret;
+}
+
+/**
+ * \brief Points the device directory of <code>pair</code> at the mount
+ * point of its filesystem, if it is known by UUID or label.
+ * \return 0 if the pair has a device directory, -1 if its filesystem is
+ * not mounted.
+ */
+int
+device_mount (struct sync_pair *pair)
+{
+        char mount[PATH_MAX];
+
+        if (pair->device_uuid == NULL && pair->device_label == NULL)
+                return pair->dev_path ? 0 : -1;
+
+        free (pair->dev_path);
+        pair->dev_path = NULL;
+        if (mount_find (pair->device_uuid, pair->device_label, mount))
+                return -1;
+        pair->dev_path = strdup (mount);
+
+        return pair->dev_path ? 0 : -1;
+}
+
+/**
+ * \brief Tells if the sync under way should stop, because the device of
+ * its pair was unmounted. Any thread may ask: it costs a
+ * <code>poll()</code> of <code>mount_fd</code>, and the mounts are only
+ * read again when they changed.
+ */
+int
+sync_cancelled ()
+{
+        char mount[PATH_MAX];
+        struct pollfd pfd;
+
+        if (__atomic_load_n (&sync_stop, __ATOMIC_RELAXED))
+                return 1;
+        if (mount_fd < 0 || (device_uuid == NULL && device_label == NULL))
+                return 0;
+
+        pfd.fd = mount_fd;
+        pfd.events = POLLPRI;
+        if (poll (&pfd, 1, 0) <= 0)
+                return 0;
+
+        /* The daemon missed this wake up, it has to look as well. */
+        __atomic_store_n (&mount_changed, 1, __ATOMIC_RELAXED);
+        if ((dev_path == NULL || mount_find (device_uuid, device_label, mount) || strcmp (mount, dev_path)) &&
+            !__atomic_exchange_n (&sync_stop, 1, __ATOMIC_RELAXED))
+                report ("The device went away, the sync stops", 0);
+
+        return __atomic_load_n (&sync_stop, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief Open and read the configuration file.
+ * Get <code>conf_path</code>, open and read
+ * the settings file, collecting user options. The device and source
+ * directories at the top make a pair, and each <code>sync</code>
+ * section another, with its own options; what a section leaves out is
+ * taken from the top. The first pair is left in use.
+ *
+ * \param conf_path Path of configuration file.
+ * \return Not implemented yet.
+ * \see confuse.h
+ */
+int
+read_option (const char *conf_path, uid_t owner, gid_t group)
+{
+        char file_path[PATH_MAX], msg[MAX_INPUT];
+        int fd, i;
+        unsigned int n;
+        FILE *conf_file;
+        cfg_t *cfg, *sec;
+        struct sync_pair *pair;
+        cfg_opt_t pair_opts[] = {
+                CFG_STR ("device_path", NULL, CFGF_NODEFAULT),
+                CFG_STR ("source_path", NULL, CFGF_NODEFAULT),
+                CFG_STR ("device_uuid", NULL, CFGF_NODEFAULT),
+                CFG_STR ("device_label", NULL, CFGF_NODEFAULT),
+                CFG_INT ("quiet_window", 0, CFGF_NODEFAULT),
+                CFG_INT ("max_latency", 0, CFGF_NODEFAULT),
+                CFG_INT ("large_file", 0, CFGF_NODEFAULT),
+                CFG_INT ("bandwidth_limit", 0, CFGF_NODEFAULT),
+                CFG_INT ("iops_limit", 0, CFGF_NODEFAULT),
+                CFG_BOOL ("in_place", cfg_false, CFGF_NODEFAULT),
+                CFG_BOOL ("plan", cfg_false, CFGF_NODEFAULT),
+                CFG_END()
+        };
+        cfg_opt_t opts[] = {
+                CFG_SIMPLE_STR ("device_path", &dev_path),
+                CFG_SIMPLE_STR ("source_path", &src_path),
+                CFG_SIMPLE_STR ("device_uuid", &device_uuid),
+                CFG_SIMPLE_STR ("device_label", &device_label),
+                CFG_SIMPLE_INT ("quiet_window", &quiet_window),
+                CFG_SIMPLE_INT ("max_latency", &max_latency),
+                CFG_SIMPLE_INT ("workers", &workers),
+                CFG_SIMPLE_BOOL ("manifest", &use_manifest),
+                CFG_SIMPLE_BOOL ("in_place", &in_place),
+                CFG_SIMPLE_BOOL ("io_uring", &use_uring),
+                CFG_SIMPLE_INT ("queue_depth", &queue_depth),
+                CFG_SIMPLE_INT ("stream_size", &stream_size),
+                CFG_SIMPLE_BOOL ("direct_io", &direct_io),
+                CFG_SIMPLE_INT ("resume_size", &resume_size),
+                CFG_SIMPLE_INT ("checkpoint_size", &checkpoint_size),
+                CFG_SIMPLE_BOOL ("check_ctime", &check_ctime),
+                CFG_SIMPLE_BOOL ("check_inode", &check_inode),
+                CFG_SIMPLE_INT ("modify_window", &modify_window),
+                CFG_SIMPLE_BOOL ("plan", &use_plan),
+                CFG_SIMPLE_STR ("io_class", &io_class_name),
+                CFG_SIMPLE_INT ("io_priority", &io_priority),
+                CFG_SIMPLE_INT ("bandwidth_limit", &bandwidth_limit),
+                CFG_SIMPLE_INT ("iops_limit", &iops_limit),
+                CFG_SIMPLE_INT ("large_file", &large_file),
+                CFG_SIMPLE_STR ("durability", &durability_name),
+                CFG_SIMPLE_INT ("batch_files", &batch_files),
+                CFG_SIMPLE_INT ("batch_size", &batch_size),
+                CFG_SIMPLE_STR ("dedup", &dedup_name),
+                CFG_SIMPLE_STR ("verify", &verify_name),
+                CFG_SIMPLE_STR ("control_socket", &control_path),
+                CFG_SIMPLE_STR ("log_file", &log_path),
+                CFG_SIMPLE_STR ("log_level", &log_level_name),
+                CFG_SIMPLE_INT ("log_max_size", &log_max_size),
+                CFG_SIMPLE_INT ("log_keep", &log_keep),
+                CFG_SIMPLE_INT ("log_rate", &log_rate),
+                CFG_SEC ("sync", pair_opts, CFGF_MULTI | CFGF_TITLE | CFGF_NO_TITLE_DUPES),
+                CFG_END()
+        };
+
+        fd = open_dir (AT_FDCWD, conf_path, DIR_MODE, owner, group);
+        if (fd >= 0)
+                close (fd);
+
+        snprintf (file_path, PATH_MAX, "%s/.cpusb", conf_path);
+        conf_file = fopen (file_path, "a");
+        if (!conf_file)
+        {
+                snprintf (msg, MAX_INPUT, "Can't open the configuration file in %s", conf_path);
+                fatal (msg, errno);
+        }
+        else
+                fclose (conf_file);
+
+        cfg = cfg_init (opts, 0);
+        cfg_parse (cfg, file_path);
+
+        for (i = 0; log_level_name && log_names[i]; i++)
+                if (!strcmp (log_level_name, log_names[i]))
+                        log_level = i;
+        log_reopen ();
+
+        if (durability_name && !strcmp (durability_name, "none"))
+                durability = DURABLE_NONE;
+        else if (durability_name && !strcmp (durability_name, "file"))
+                durability = DURABLE_FILE;
+        else if (durability_name && !strcmp (durability_name, "batch"))
+                durability = DURABLE_BATCH;
+        else if (durability_name)
+        {
+                snprintf (msg, MAX_INPUT, "Unknown durability %s", durability_name);
+                report (msg, EINVAL);
+        }
+
+        if (dedup_name && !strcmp (dedup_name, "reflink"))
+                dedup_mode = DEDUP_REFLINK;
+        else if (dedup_name && !strcmp (dedup_name, "hardlink"))
+                dedup_mode = DEDUP_HARDLINK;
+        else if (dedup_name && strcmp (dedup_name, "off"))
+        {
+                snprintf (msg, MAX_INPUT, "Unknown dedup %s", dedup_name);
+                report (msg, EINVAL);
+        }
+
+        if (verify_name && !strcmp (verify_name, "readback"))
+                verify_mode = VERIFY_READBACK;
+        else if (verify_name && !strcmp (verify_name, "stored"))
+                verify_mode = VERIFY_STORED;
+        else if (verify_name && strcmp (verify_name, "off"))
+        {
+                snprintf (msg, MAX_INPUT, "Unknown verify %s", verify_name);
+                report (msg, EINVAL);
+        }
+
+        free (manifest_path);
+        manifest_path = malloc (PATH_MAX);
+        if (manifest_path)
+                snprintf (manifest_path, PATH_MAX, "%s/.cpusb.manifest", conf_path);
+        free (dedup_path);
+        dedup_path = malloc (PATH_MAX);
+        if (dedup_path)
+                snprintf (dedup_path, PATH_MAX, "%s/.cpusb.dedup", conf_path);
+        free (journal_path);
+        journal_path = malloc (PATH_MAX);
+        if (journal_path)
+                snprintf (journal_path, PATH_MAX, "%s/.cpusb.journal", conf_path);
+
+        if (control_path == NULL && (control_path = malloc (PATH_MAX)))
+                snprintf (control_path, PATH_MAX, "%s/.cpusb.sock", conf_path);
+
+        if (dev_path || src_path || device_uuid || device_label)
+                pair_add (NULL);
+        for (n = 0; n < cfg_size (cfg, "sync"); n++)
+        {
+                sec = cfg_getnsec (cfg, "sync", n);
+                /* The name is part of the manifest file name. */
+                if (strchr (cfg_title (sec), '/'))
+                {
+                        snprintf (msg, MAX_INPUT, "Bad name of sync section: %s", cfg_title (sec));
+                        report (msg, EINVAL);
+                        continue;
+                }
+                pair = pair_add (cfg_title (sec));
+                pair_read (pair, sec, conf_path);
+        }
+        cfg_free (cfg);
+
+        if (pair_count == 0)
+                fatal ("No device and source directories to sync", EINVAL);
+        for (i = 0; i < pair_count; i++)
+        {
+                if ((pairs[i].dev_path == NULL && pairs[i].device_uuid == NULL && pairs[i].device_label == NULL) ||
+                    pairs[i].src_path == NULL)
+                {
+                        snprintf (msg, MAX_INPUT, "The pair %s lacks its device or source directory",
+                                  pairs[i].name ? pairs[i].name : "at the top");
+                        fatal (msg, EINVAL);
+                }
+                if (pairs[i].device_uuid || pairs[i].device_label)
+                {
+                        /* Wherever its filesystem gets mounted, see device_mount(). */
+                        free (pairs[i].dev_path);
+                        pairs[i].dev_path = NULL;
+                }
+                else if ((fd = open_dir (AT_FDCWD, pairs[i].dev_path, DIR_MODE, owner, group)) < 0)
+                {
+                        snprintf (msg, MAX_INPUT, "Can't access the device directory: %s", pairs[i].dev_path);
+                        fatal (msg, errno);
+                }
+                else
+                        close (fd);
+                if ((fd = open_dir (AT_FDCWD, pairs[i].src_path, DIR_MODE, owner, group)) < 0)
+                {
+                        snprintf (msg, MAX_INPUT, "Can't access the source directory: %s", pairs[i].src_path);
+                        fatal (msg, errno);
+                }
+                close (fd);
+        }
+        pair_use (&pairs[0]);
+
+        /**
+         * \todo Implement the return stament 
+         */
+        return 1;
+}
+
+void
+install_conf (const char *conf_path, uid_t owner, gid_t group)
+{
+        char file_path[PATH_MAX], msg[MAX_INPUT];
+        int fd;
+        FILE *conf_file;
+
+        fd = open_dir (AT_FDCWD, conf_path, DIR_MODE, owner, group);
+        if (fd >= 0)
+                close (fd);
+
+        snprintf (file_path, PATH_MAX, "%s/.cpusb", conf_path);
+        conf_file = fopen (file_path, "w+");
+        if (!conf_file)
+        {
+                snprintf (msg, MAX_INPUT, "Can't open the configuration file in %s", conf_path);
+                fatal (msg, errno);
+        }
+
+        fflush (stdin);
+
+        dev_path = readline ("Device directory: ");
+        fprintf (conf_file, "device_path = %s\n", dev_path);
+        /** \todo error handling. */
+
+        src_path = readline ("Destination directory: ");
+        fprintf (conf_file, "source_path = %s\n", src_path);
+        /** \todo error handling. */
+
+        if (fclose (conf_file))
+                report ("Configuration file was closed with error", errno);
+}
+
+/**
+ * \def SCHED_CHUNK
+ * Most bytes a copy moves at once while <code>bandwidth_limit</code> or
+ * <code>iops_limit</code> is set, so the limits hold within a file.
+ */
+#define SCHED_CHUNK (256 * Kb)
+
+/**
+ * \brief Applies <code>io_class</code> and <code>io_priority</code>.
+ * The priority is kept by each thread, and the threads created later
+ * inherit it, so this is called before any worker starts.
+ */
+void
+sched_init ()
+{
+        char msg[MAX_INPUT];
+        int class;
+
+        if (io_class_name == NULL)
+                return;
+
+        if (!strcmp (io_class_name, "idle"))
+                class = IOPRIO_CLASS_IDLE;
+        else if (!strcmp (io_class_name, "best-effort"))
+                class = IOPRIO_CLASS_BE;
+        else if (!strcmp (io_class_name, "realtime"))
+                class = IOPRIO_CLASS_RT;
+        else
+        {
+                snprintf (msg, MAX_INPUT, "Unknown io_class %s", io_class_name);
+                report (msg, EINVAL);
+                return;
+        }
+
+        if (syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE (class, io_priority)))
+                report ("Can't set the I/O priority", errno);
+}
+
+/**
+ * \brief Waits until <code>want</code> bytes may be copied.
+ * Without limits, returns at once with all of <code>want</code>.
+ * Otherwise, at most <code>SCHED_CHUNK</code> bytes are granted, which
+ * cost one operation, and the caller sleeps as long as the bucket asks.
+ *
+ * \param want Bytes the caller would like to copy.
+ * \return The bytes granted, to be copied in one operation.
+ */
+off_t
+sched_take (off_t want)
+{
+        double wait = 0, debt;
+        long long now;
+        struct timespec ts;
+
+        if (bandwidth_limit <= 0 && iops_limit <= 0)
+                return want;
+        if (want > SCHED_CHUNK)
+                want = SCHED_CHUNK;
+
+        pthread_mutex_lock (&bucket->lock);
+        now = now_us ();
+        if (bucket->last == 0)
+        {
+                bucket->bytes = bandwidth_limit * Kb;
+                bucket->ops = iops_limit;
+        }
+        else
+        {
+                bucket->bytes += (now - bucket->last) / 1e6 * bandwidth_limit * Kb;
+                bucket->ops += (now - bucket->last) / 1e6 * iops_limit;
+                if (bucket->bytes > bandwidth_limit * Kb)
+                        bucket->bytes = bandwidth_limit * Kb;
+                if (bucket->ops > iops_limit)
+                        bucket->ops = iops_limit;
+        }
+        bucket->last = now;
+
+        if (bandwidth_limit > 0)
+        {
+                bucket->bytes -= want;
+                if (bucket->bytes < 0)
+                        wait = -bucket->bytes / (bandwidth_limit * Kb);
+        }
+        if (iops_limit > 0)
+        {
+                bucket->ops -= 1;
+                debt = bucket->ops < 0 ? -bucket->ops / iops_limit : 0;
+                if (debt > wait)
+                        wait = debt;
+        }
+        pthread_mutex_unlock (&bucket->lock);
+
+        if (wait > 0)
+        {
+                ts.tv_sec = wait;
+                ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+                while (nanosleep (&ts, &ts) && errno == EINTR)
+                        ;
+        }
+
+        return want;
+}
+
+/**
+ * \def XXH_P1
+ * The primes of XXH64, <code>XXH_P1</code> to <code>XXH_P5</code>.
+ */
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+/**
+ * \struct xxh64
+ * \brief State of an XXH64 hash, fed a piece at a time.
+ * Four lanes of 64 bits take 32 bytes per round, which the compiler
+ * keeps in registers; what is left of a round waits in <code>buf</code>.
+ */
+struct xxh64
+{
+        uint64_t v[4];
+        uint64_t total;
+        unsigned char buf[32];
+        size_t buffered;
+};
+
+/**
+ * \brief Rotates <code>x</code> left by <code>r</code> bits.
+ */
+uint64_t
+xxh64_rotl (uint64_t x, int r)
+{
+        return (x << r) | (x >> (64 - r));
+}
+
+/**
+ * \brief Reads 64 bits, little endian, from anywhere.
+ */
+uint64_t
+xxh64_read (const unsigned char *p)
+{
+        uint64_t v;
+
+        memcpy (&v, p, sizeof (v));
+
+        return v;
+}
+
+/**
+ * \brief Mixes 8 bytes of input into the lane <code>acc</code>.
+ */
+uint64_t
+xxh64_round (uint64_t acc, uint64_t input)
+{
+        acc += input * XXH_P2;
+        acc = xxh64_rotl (acc, 31);
+
+        return acc * XXH_P1;
+}
+
+/**
+ * \brief Starts a hash, with seed 0.
+ */
+void
+xxh64_init (struct xxh64 *state)
+{
+        memset (state, 0, sizeof (struct xxh64));
+        state->v[0] = XXH_P1 + XXH_P2;
+        state->v[1] = XXH_P2;
+        state->v[2] = 0;
+        state->v[3] = -XXH_P1;
+}
+
+/**
+ * \brief Feeds <code>len</code> bytes of <code>data</code> to the hash.
+ */
+void
+xxh64_update (struct xxh64 *state, const void *data, size_t len)
+{
+        const unsigned char *p = data;
+        size_t fill;
+
+        state->total += len;
+        if (state->buffered + len < 32)
+        {
+                memcpy (state->buf + state->buffered, p, len);
+                state->buffered += len;
+                return;
+        }
+
+        if (state->buffered)
+        {
+                fill = 32 - state->buffered;
+                memcpy (state->buf + state->buffered, p, fill);
+                state->v[0] = xxh64_round (state->v[0], xxh64_read (state->buf));
+                state->v[1] = xxh64_round (state->v[1], xxh64_read (state->buf + 8));
+                state->v[2] = xxh64_round (state->v[2], xxh64_read (state->buf + 16));
+                state->v[3] = xxh64_round (state->v[3], xxh64_read (state->buf + 24));
+                p += fill;
+                len -= fill;
+                state->buffered = 0;
+        }
+
+        for (; len >= 32; p += 32, len -= 32)
+        {
+                state->v[0] = xxh64_round (state->v[0], xxh64_read (p));
+                state->v[1] = xxh64_round (state->v[1], xxh64_read (p + 8));
+                state->v[2] = xxh64_round (state->v[2], xxh64_read (p + 16));
+                state->v[3] = xxh64_round (state->v[3], xxh64_read (p + 24));
+        }
+
+        memcpy (state->buf, p, len);
+        state->buffered = len;
+}
+
+/**
+ * \brief Ends the hash.
+ * \return The XXH64 of all the bytes fed, never 0, which stands for
+ * "unknown" in the manifest.
+ */
+uint64_t
+xxh64_final (const struct xxh64 *state)
+{
+        const unsigned char *p = state->buf;
+        size_t len = state->buffered;
+        uint32_t word;
+        uint64_t h;
+        int i;
+
+        if (state->total >= 32)
+        {
+                h = xxh64_rotl (state->v[0], 1) + xxh64_rotl (state->v[1], 7) +
+                    xxh64_rotl (state->v[2], 12) + xxh64_rotl (state->v[3], 18);
+                for (i = 0; i < 4; i++)
+                        h = (h ^ xxh64_round (0, state->v[i])) * XXH_P1 + XXH_P4;
+        }
+        else
+                h = state->v[2] + XXH_P5;
+        h += state->total;
+
+        for (; len >= 8; p += 8, len -= 8)
+                h = xxh64_rotl (h ^ xxh64_round (0, xxh64_read (p)), 27) * XXH_P1 + XXH_P4;
+        if (len >= 4)
+        {
+                memcpy (&word, p, sizeof (word));
+                h = xxh64_rotl (h ^ (word * XXH_P1), 23) * XXH_P2 + XXH_P3;
+                p += 4;
+                len -= 4;
+        }
+        for (; len; p++, len--)
+                h = xxh64_rotl (h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+        h ^= h >> 33;
+        h *= XXH_P2;
+        h ^= h >> 29;
+        h *= XXH_P3;
+        h ^= h >> 32;
+
+        return h ? h : 1;
+}
+
+/**
+ * \brief Feeds <code>len</code> zeros to the hash, what a hole reads as.
+ * Does nothing without <code>state</code>.
+ */
+void
+xxh64_zeros (struct xxh64 *state, off_t len)
+{
+        static const unsigned char zeros[4096];
+
+        if (state == NULL)
+                return;
+
+        for (; len > 0; len -= sizeof (zeros))
+                xxh64_update (state, zeros, len < (off_t) sizeof (zeros) ? (size_t) len : sizeof (zeros));
+}
+
+/**
+ * \struct copy_backend
+ * \brief One way to move the bytes of a file.
+ * Each backend copies from <code>*done</code> up to <code>size</code>,
+ * advancing <code>*done</code>. It returns 0 when the file is complete,
+ * 1 if it can't be used for this pair of files, so the next one is tried,
+ * and -1 on error. Given <code>hash</code>, the bytes copied are fed to
+ * it, in order; the backends whose bytes never reach user space can't,
+ * and <code>hashes</code> is 0 for them.
+ */
+struct copy_backend
+{
+        const char *name;
+        int (*run) (int fd_in, int fd_out, off_t size, off_t *done, struct xxh64 *hash);
+        int hashes;
+};
+
+/**
+ * \brief Tells if <code>err</code> means "not supported here".
+ * The kernel copy calls fail in many ways when the filesystems involved
+ * can't do the job, those errors only mean that another backend is needed.
+ *
+ * \param err contains <code>errno</code>.
+ * \return True if the next backend should be tried.
+ */
+int
+copy_unsupported (const int err)
+{
+        return err == EXDEV || err == EINVAL || err == ENOSYS ||
+               err == EOPNOTSUPP || err == ENOTTY || err == EPERM;
+}
+
+/**
+ * \brief Shares the extents of the file, without copying any byte.
+ * Works only inside the same btrfs or XFS filesystem, and only for the
+ * whole file.
+ */
+int
+copy_reflink (int fd_in, int fd_out, off_t size, off_t *done, struct xxh64 *hash)
+{
+#ifdef FICLONE
+        if (*done || hash)
+                return 1;
+
+        if (ioctl (fd_out, FICLONE, fd_in))
+                return copy_unsupported (errno) ? 1 : -1;
+
+        *done = size;
+        return 0;
+#else
+        return 1;
+#endif
+}
+
+/**
+ * \brief Copies inside the kernel with <code>copy_file_range()</code>.
+ * The filesystem may offload the copy, even between two devices.
+ */
+int
+copy_range (int fd_in, int fd_out, off_t size, off_t *done, struct xxh64 *hash)
+{
+        loff_t off_in = *done, off_out = *done;
+        ssize_t len;
+
+        if (hash)
+                return 1;
+
+        while (*done < size)
+        {
+                len = copy_file_range (fd_in, &off_in, fd_out, &off_out, sched_take (size - *done), 0);
+                if (len < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return copy_unsupported (errno) ? 1 : -1;
+                }
+                /* The file was truncated while copying. */
+                if (len == 0)
+                        break;
+                *done += len;
+        }
+
+        return 0;
+}
+
+/**
+ * \brief Copies inside the kernel with <code>sendfile()</code>.
+ * Older kernels have no <code>copy_file_range()</code> between devices,
+ * but still avoid the user space buffer this way.
+ */
+int
+copy_sendfile (int fd_in, int fd_out, off_t size, off_t *done, struct xxh64 *hash)
+{
+        off_t off = *done;
+        ssize_t len;
+
+        if (hash)
+                return 1;
+        if (lseek (fd_out, *done, SEEK_SET) < 0)
+                return -1;
+
+        while (*done < size)
+        {
+                len = sendfile (fd_out, fd_in, &off, sched_take (size - *done));
+                if (len < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return copy_unsupported (errno) ? 1 : -1;
+                }
+                if (len == 0)
+                        break;
+                *done += len;
+        }
+
+        return 0;
+}
+
+/**
+ * \var pthread_key_t copy_buf_key
+ * The buffers of <code>copy_buf()</code>, one per thread.
+ */
+pthread_key_t copy_buf_key;
+
+/**
+ * \brief Creates <code>copy_buf_key</code>, the buffer is freed with its thread.
+ */
+void
+copy_buf_init ()
+{
+        pthread_key_create (&copy_buf_key, free);
+}
+
+/**
+ * \brief Gives the buffers of the calling thread.
+ * Two buffers of <code>COPY_BUF</code> bytes, one after the other,
+ * allocated once per thread and reused for every file. They are aligned
+ * for <code>O_DIRECT</code>.
+ *
+ * \return The first buffer, NULL if there is no memory.
+ */
+char *
+copy_buf ()
+{
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        char *buf;
+
+        pthread_once (&once, copy_buf_init);
+        buf = pthread_getspecific (copy_buf_key);
+        if (buf == NULL)
+        {
+                if (posix_memalign ((void **) &buf, STREAM_ALIGN, 2 * COPY_BUF))
+                        return NULL;
+                pthread_setspecific (copy_buf_key, buf);
+        }
+
+        return buf;
+}
+
+/**
+ * \brief Reads up to <code>len</code> bytes at <code>off</code>.
+ * Stops short only at the end of the file.
+ *
+ * \return Bytes read, -1 on error.
+ */
+ssize_t
+pread_full (int fd, char *buf, size_t len, off_t off)
+{
+        ssize_t rd;
+        size_t pos = 0;
+
+        while (pos < len)
+        {
+                rd = pread (fd, buf + pos, len - pos, off + pos);
+                if (rd < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                if (rd == 0)
+                        break;
+                pos += rd;
+        }
+
+        return pos;
+}
+
+/**
+ * \brief Writes all <code>len</code> bytes at <code>off</code>.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+pwrite_all (int fd, const char *buf, size_t len, off_t off)
+{
+        ssize_t wr;
+        size_t pos = 0;
+
+        while (pos < len)
+        {
+                wr = pwrite (fd, buf + pos, len - pos, off + pos);
+                if (wr < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        return -1;
+                }
+                pos += wr;
+        }
+
+        return 0;
+}
+
+/**
+ * \brief Copies through a buffer of <code>COPY_BUF</code> bytes.
+ * The last resort, it works everywhere.
+ */
+int
+copy_buffer (int fd_in, int fd_out, off_t size, off_t *done, struct xxh64 *hash)
+{
+        char *buf;
+        ssize_t rd;
+
+        if ((buf = copy_buf ()) == NULL)
+                return -1;
+
+        while (*done < size)
+        {
+                rd = pread_full (fd_in, buf, sched_take (size - *done < COPY_BUF ? size - *done : COPY_BUF), *done);
+                if (rd < 0)
+                        return -1;
+                if (rd == 0)
+                        break;
+                if (pwrite_all (fd_out, buf, rd, *done))
+                        return -1;
+                if (hash)
+                        xxh64_update (hash, buf, rd);
+                *done += rd;
+        }
+
+        return 0;
+}
+
+/**
+ * \struct uring
+ * \brief An io_uring instance of one thread, with its registered buffers.
+ * The rings are shared with the kernel, the pointers below are into them.
+ */
+struct uring
+{
+        int fd;
+        unsigned depth;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ring, *cq_ring;
+        size_t sq_len, cq_len, sqes_len;
+        char *bufs;
+};
+
+/**
+ * \var pthread_key_t uring_key
+ * The <code>uring</code> of each thread.
+ *
+ * \var int uring_broken
+ * Set when the kernel refuses io_uring, so no thread tries it again.
+ */
+pthread_key_t uring_key;
+int uring_broken;
+
+/**
+ * \brief Releases <code>arg</code>, an <code>uring</code>.
+ */
+void
+uring_free (void *arg)
+{
+        struct uring *ring = arg;
+
+        if (ring == NULL)
+                return;
+
+        if (ring->sqes)
+                munmap (ring->sqes, ring->sqes_len);
+        if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+                munmap (ring->cq_ring, ring->cq_len);
+        if (ring->sq_ring)
+                munmap (ring->sq_ring, ring->sq_len);
+        if (ring->fd >= 0)
+                close (ring->fd);
+        free (ring->bufs);
+        free (ring);
+}
+
+/**
+ * \brief Creates <code>uring_key</code>, the ring is released with its thread.
+ */
+void
+uring_init ()
+{
+        pthread_key_create (&uring_key, uring_free);
+}
+
+/**
+ * \brief Sets up an io_uring with <code>depth</code> registered buffers.
+ * \return The ring, NULL if the kernel can't give one.
+ */
+struct uring *
+uring_new (unsigned depth)
+{
+#ifdef __NR_io_uring_setup
+        char *p;
+        unsigned i;
+        struct io_uring_params params;
+        struct iovec *iov;
+        struct uring *ring;
+
+        ring = calloc (1, sizeof (struct uring));
+        if (ring == NULL)
+                return NULL;
+        ring->fd = -1;
+        ring->depth = depth;
+
+        memset (&params, 0, sizeof (struct io_uring_params));
+        ring->fd = syscall (__NR_io_uring_setup, depth, &params);
+        if (ring->fd < 0)
+        {
+                uring_free (ring);
+                return NULL;
+        }
+
+        ring->sq_len = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+        ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP && ring->cq_len > ring->sq_len)
+                ring->sq_len = ring->cq_len;
+
+        ring->sq_ring = mmap (NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED)
+        {
+                ring->sq_ring = NULL;
+                uring_free (ring);
+                return NULL;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+                ring->cq_ring = ring->sq_ring;
+        else
+        {
+                ring->cq_ring = mmap (NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+                if (ring->cq_ring == MAP_FAILED)
+                {
+                        ring->cq_ring = NULL;
+                        uring_free (ring);
+                        return NULL;
+                }
+        }
+        ring->sqes_len = params.sq_entries * sizeof (struct io_uring_sqe);
+        ring->sqes = mmap (NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sqes == MAP_FAILED)
+        {
+                ring->sqes = NULL;
+                uring_free (ring);
+                return NULL;
+        }
+
+        p = ring->sq_ring;
+        ring->sq_head = (unsigned *) (p + params.sq_off.head);
+        ring->sq_tail = (unsigned *) (p + params.sq_off.tail);
+        ring->sq_mask = (unsigned *) (p + params.sq_off.ring_mask);
+        ring->sq_array = (unsigned *) (p + params.sq_off.array);
+        p = ring->cq_ring;
+        ring->cq_head = (unsigned *) (p + params.cq_off.head);
+        ring->cq_tail = (unsigned *) (p + params.cq_off.tail);
+        ring->cq_mask = (unsigned *) (p + params.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *) (p + params.cq_off.cqes);
+
+        /* The buffers are pinned once, and not mapped again at each I/O. */
+        ring->bufs = malloc ((size_t) depth * URING_BLOCK);
+        iov = calloc (depth, sizeof (struct iovec));
+        if (ring->bufs == NULL || iov == NULL)
+        {
+                free (iov);
+                uring_free (ring);
+                return NULL;
+        }
+        for (i = 0; i < depth; i++)
+        {
+                iov[i].iov_base = ring->bufs + (size_t) i * URING_BLOCK;
+                iov[i].iov_len = URING_BLOCK;
+        }
+        if (syscall (__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, depth))
+        {
+                free (iov);
+                uring_free (ring);
+                return NULL;
+        }
+        free (iov);
+
+        return ring;
+#else
+        return NULL;
+#endif
+}
+
+/**
+ * \brief Gives the <code>uring</code> of the calling thread.
+ * \return The ring, NULL if io_uring can't be used.
+ */
+struct uring *
+uring_get ()
+{
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        struct uring *ring;
+
+        if (__atomic_load_n (&uring_broken, __ATOMIC_RELAXED))
+                return NULL;
+
+        pthread_once (&once, uring_init);
+        ring = pthread_getspecific (uring_key);
+        if (ring == NULL)
+        {
+                ring = uring_new (queue_depth > 0 ? queue_depth : 1);
+                if (ring == NULL)
+                {
+                        report ("io_uring is not available, copying without it", errno);
+                        __atomic_store_n (&uring_broken, 1, __ATOMIC_RELAXED);
+                        return NULL;
+                }
+                pthread_setspecific (uring_key, ring);
+        }
+
+        return ring;
+}
+
+/**
+ * \brief Queues a fixed buffer read or write of the block <code>slot</code>.
+ * The tag in <code>user_data</code> tells the slot, and if it is a write.
+ */
+void
+uring_queue (struct uring *ring, int opcode, int fd, unsigned slot, size_t pos, size_t len, off_t off)
+{
+        unsigned tail, index;
+        struct io_uring_sqe *sqe;
+
+        tail = *ring->sq_tail;
+        index = tail & *ring->sq_mask;
+        sqe = &ring->sqes[index];
+        memset (sqe, 0, sizeof (struct io_uring_sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t) (ring->bufs + (size_t) slot * URING_BLOCK + pos);
+        sqe->len = len;
+        sqe->off = off;
+        sqe->buf_index = slot;
+        sqe->user_data = slot | (uint64_t) (opcode == IORING_OP_WRITE_FIXED) << 32;
+        ring->sq_array[index] = index;
+        __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief Copies with io_uring, <code>queue_depth</code> blocks at a time.
+ * Each block is read into its registered buffer and, as soon as the read
+ * completes, written out, while the other blocks are still being read or
+ * written. So the device and the destination work at the same time.
+ */
+int
+copy_uring (int fd_in, int fd_out, off_t size, off_t *done, struct xxh64 *hash)
+{
+        int ret = 0;
+        unsigned head, i, slot, submit = 0, inflight = 0;
+        off_t next = *done, end = size;
+        struct io_uring_cqe *cqe;
+        struct uring *ring;
+        struct
+        {
+                off_t off;
+                size_t len, pos;
+        } *blocks;
+
+        /* The blocks complete out of order, they can't be hashed. */
+        if (!use_uring || hash || (ring = uring_get ()) == NULL)
+                return 1;
+
+        blocks = calloc (ring->depth, sizeof (*blocks));
+        if (blocks == NULL)
+                return 1;
+
+        for (i = 0; i < ring->depth && next < size; i++, submit++, inflight++)
+        {
+                blocks[i].off = next;
+                blocks[i].len = sched_take (size - next < URING_BLOCK ? size - next : URING_BLOCK);
+                blocks[i].pos = 0;
+                uring_queue (ring, IORING_OP_READ_FIXED, fd_in, i, 0, blocks[i].len, next);
+                next += blocks[i].len;
+        }
+
+        while (inflight)
+        {
+                if (syscall (__NR_io_uring_enter, ring->fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+                {
+                        if (errno == EINTR)
+                                continue;
+                        ret = -1;
+                        break;
+                }
+                submit = 0;
+
+                head = *ring->cq_head;
+                while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+                {
+                        cqe = &ring->cqes[head & *ring->cq_mask];
+                        slot = cqe->user_data & 0xffffffff;
+                        head++;
+                        inflight--;
+
+                        if (cqe->res < 0)
+                        {
+                                /* Refused at the first block, other backends may do it. */
+                                if (*done == 0 && next <= ring->depth * (off_t) URING_BLOCK &&
+                                    copy_unsupported (-cqe->res))
+                                        ret = ret ? ret : 1;
+                                else
+                                        ret = -1;
+                                errno = -cqe->res;
+                                continue;
+                        }
+                        if (ret)
+                                continue;
+
+                        if (cqe->user_data >> 32)
+                        {
+                                /* A short write goes on from where it stopped. */
+                                blocks[slot].pos += cqe->res;
+                                if (blocks[slot].pos < blocks[slot].len)
+                                {
+                                        uring_queue (ring, IORING_OP_WRITE_FIXED, fd_out, slot, blocks[slot].pos,
+                                                     blocks[slot].len - blocks[slot].pos, blocks[slot].off + blocks[slot].pos);
+                                        submit++;
+                                        inflight++;
+                                        continue;
+                                }
+                                if (next < end)
+                                {
+                                        blocks[slot].off = next;
+                                        blocks[slot].len = sched_take (end - next < URING_BLOCK ? end - next : URING_BLOCK);
+                                        blocks[slot].pos = 0;
+                                        uring_queue (ring, IORING_OP_READ_FIXED, fd_in, slot, 0, blocks[slot].len, next);
+                                        next += blocks[slot].len;
+                                        submit++;
+                                        inflight++;
+                                }
+                        }
+                        else
+                        {
+                                /* The file was truncated while copying. */
+                                if ((size_t) cqe->res < blocks[slot].len)
+                                {
+                                        blocks[slot].len = cqe->res;
+                                        if (blocks[slot].off + cqe->res < end)
+                                                end = blocks[slot].off + cqe->res;
+                                }
+                                if (blocks[slot].len == 0)
+                                        continue;
+                                uring_queue (ring, IORING_OP_WRITE_FIXED, fd_out, slot, 0, blocks[slot].len, blocks[slot].off);
+                                submit++;
+                                inflight++;
+                        }
+                }
+                __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        free (blocks);
+        if (ret == 0)
+                *done = end;
+
+        return ret;
+}
+
+/**
+ * \var struct copy_backend copy_backends[]
+ * The backends tried by <code>copy_data()</code>, from the cheapest to
+ * the most expensive. The last one must always work. io_uring is only
+ * tried when asked for, in <code>use_uring</code>.
+ */
+struct copy_backend copy_backends[] = {
+        {"reflink", copy_reflink, 0},
+        {"io_uring", copy_uring, 0},
+        {"copy_file_range", copy_range, 0},
+        {"sendfile", copy_sendfile, 0},
+        {"buffer", copy_buffer, 1},
+        {NULL, NULL, 0}
+};
+
+/**
+ * \brief Drops the window of <code>len</code> bytes at <code>off</code>
+ * from the page cache, on both sides. The written pages are dirty, and
+ * can't be dropped before they reach the disk, so they are waited for.
+ */
+void
+stream_drop (int fd_in, int fd_out, off_t off, off_t len)
+{
+        if (len <= 0)
+                return;
+
+        sync_file_range (fd_out, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise (fd_out, off, len, POSIX_FADV_DONTNEED);
+        posix_fadvise (fd_in, off, len, POSIX_FADV_DONTNEED);
+}
+
+/**
+ * \brief Sets or clears <code>O_DIRECT</code> on both files.
+ * \return 0 on success, -1 if a filesystem refused it.
+ */
+int
+stream_direct (int fd_in, int fd_out, int on)
+{
+        int fl_in = fcntl (fd_in, F_GETFL), fl_out = fcntl (fd_out, F_GETFL);
+
+        if (fl_in < 0 || fl_out < 0)
+                return -1;
+        if (on)
+        {
+                if (fcntl (fd_in, F_SETFL, fl_in | O_DIRECT))
+                        return -1;
+                if (!fcntl (fd_out, F_SETFL, fl_out | O_DIRECT))
+                        return 0;
+                fcntl (fd_in, F_SETFL, fl_in);
+                return -1;
+        }
+        fcntl (fd_in, F_SETFL, fl_in & ~O_DIRECT);
+        fcntl (fd_out, F_SETFL, fl_out & ~O_DIRECT);
+
+        return 0;
+}
+
+/**
+ * \brief Copies a large file without filling the page cache with it.
+ * The source is read sequentially, one <code>STREAM_WINDOW</code> ahead.
+ * Each window written is sent to the disk at once, and the one before it,
+ * once there, is dropped from the cache on both sides. With
+ * <code>direct_io</code>, the whole blocks go around the cache with
+ * <code>O_DIRECT</code>, and only the tail goes through it.
+ */
+int
+copy_stream (int fd_in, int fd_out, off_t size, off_t *done, struct xxh64 *hash)
+{
+        char *buf;
+        int direct = 0;
+        off_t prev = *done, mark = *done;
+        ssize_t rd = 0, want;
+
+        if ((buf = copy_buf ()) == NULL)
+                return -1;
+
+        posix_fadvise (fd_in, *done, size - *done, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise (fd_in, *done, STREAM_WINDOW, POSIX_FADV_WILLNEED);
+        if (direct_io && *done % STREAM_ALIGN == 0)
+                direct = !stream_direct (fd_in, fd_out, 1);
+
+        while (*done < size)
+        {
+                want = size - *done < COPY_BUF ? size - *done : COPY_BUF;
+                if (direct && want % STREAM_ALIGN)
+                        direct = stream_direct (fd_in, fd_out, 0);
+
+                rd = pread_full (fd_in, buf, sched_take (want), *done);
+                if (rd <= 0)
+                        break;
+                /* Shorter than expected, O_DIRECT can't write it. */
+                if (direct && rd % STREAM_ALIGN)
+                        direct = stream_direct (fd_in, fd_out, 0);
+                if (pwrite_all (fd_out, buf, rd, *done))
+                {
+                        rd = -1;
+                        break;
+                }
+                if (hash)
+                        xxh64_update (hash, buf, rd);
+                *done += rd;
+
+                if (*done - mark >= STREAM_WINDOW)
+                {
+                        sync_file_range (fd_out, mark, *done - mark, SYNC_FILE_RANGE_WRITE);
+                        posix_fadvise (fd_in, *done, STREAM_WINDOW, POSIX_FADV_WILLNEED);
+                        stream_drop (fd_in, fd_out, prev, mark - prev);
+                        prev = mark;
+                        mark = *done;
+                }
+        }
+
+        if (direct)
+                stream_direct (fd_in, fd_out, 0);
+        stream_drop (fd_in, fd_out, prev, *done - prev);
+
+        return rd < 0 ? -1 : 0;
+}
+
+/**
+ * \var struct copy_backend stream_backends[]
+ * The backends of the files of <code>stream_size</code> KiB or more. The
+ * kernel copies go through the page cache, only a reflink, which moves
+ * no byte, is tried before <code>copy_stream()</code>.
+ */
+struct copy_backend stream_backends[] = {
+        {"reflink", copy_reflink, 0},
+        {"stream", copy_stream, 1},
+        {"buffer", copy_buffer, 1},
+        {NULL, NULL, 0}
+};
+
+/**
+ * \brief Feeds <code>hash</code> the bytes of <code>fd</code> from
+ * <code>off</code> up to <code>end</code>.
+ * \return 0 on success, -1 if they can't be read whole.
+ */
+int
+file_hash (int fd, off_t off, off_t end, struct xxh64 *hash)
+{
+        char *buf;
+        ssize_t rd;
+
+        if ((buf = copy_buf ()) == NULL)
+                return -1;
+
+        while (off < end)
+        {
+                rd = pread_full (fd, buf, end - off < COPY_BUF ? end - off : COPY_BUF, off);
+                if (rd <= 0)
+                        return -1;
+                xxh64_update (hash, buf, rd);
+                off += rd;
+        }
+
+        return 0;
+}
+
+/**
+ * \struct resume_record
+ * \brief A slot of the journal: the checkpoint of a copy that can go on
+ * after an interruption. <code>key</code> names the copy, 0 for a free
+ * slot. The source is known by its inode, size and modification time,
+ * in nanoseconds. The first <code>done</code> bytes of the partial copy
+ * at <code>path</code> hash to <code>state</code>. <code>pass</code> is
+ * the last pass that used it.
+ */
+struct resume_record
+{
+        uint64_t key, ino;
+        int64_t size, mtime, done, pass;
+        struct xxh64 state;
+        char path[PATH_MAX];
+};
+
+/**
+ * \struct checkpoint
+ * \brief A resumable copy under way: where its slot is in the journal,
+ * and what the slot holds. With <code>reread</code>, the hash is only for
+ * the checkpoints, and the backends that can't hash are used anyway:
+ * what they wrote is read back.
+ */
+struct checkpoint
+{
+        off_t slot;
+        int reread;
+        struct resume_record record;
+};
+
+/**
+ * \var pthread_mutex_t journal_lock
+ * Taken to look for a slot of the journal, or to open it.
+ *
+ * \var int journal_fd
+ * The journal of the pair being synced, at <code>journal_path</code>,
+ * -1 until a copy needs it.
+ *
+ * \var int64_t journal_pass
+ * Marks the slots used by the pass under way.
+ */
+pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+int journal_fd = -1;
+int64_t journal_pass;
+
+/**
+ * \brief Checkpoints a copy at <code>done</code> bytes, which hash to
+ * <code>hash</code>. The copy reaches the disk first, so the journal
+ * never claims more than is there.
+ */
+void
+checkpoint_save (struct checkpoint *ckpt, int fd_out, off_t done, const struct xxh64 *hash)
+{
+        if (fdatasync (fd_out))
+                return;
+
+        ckpt->record.done = done;
+        ckpt->record.state = *hash;
+        /* The path doesn't change, it stays out of the write. */
+        if (pwrite_all (journal_fd, (const char *) &ckpt->record, offsetof (struct resume_record, path), ckpt->slot))
+                report ("Can't write the journal", errno);
+}
+
+/**
+ * \brief Copies from <code>*done</code> up to <code>end</code>.
+ * Tries each of <code>copy_backends</code>, from <code>backend</code> on.
+ * When one of them gives up in the middle, the next continues from there.
+ * With <code>reread</code>, the backends that can't hash copy all the
+ * same, and their bytes are read back from <code>fd_out</code> into
+ * <code>hash</code>.
+ *
+ * \return The backend that finished, NULL on error.
+ */
+struct copy_backend *
+copy_span (struct copy_backend *backend, int fd_in, int fd_out, off_t end, off_t *done, struct xxh64 *hash, int reread)
+{
+        int ret;
+        off_t start;
+        struct xxh64 *feed;
+
+        for (; backend->name; backend++)
+        {
+                start = *done;
+                feed = reread && !backend->hashes ? NULL : hash;
+                ret = backend->run (fd_in, fd_out, end, done, feed);
+                if (feed != hash && *done > start && file_hash (fd_out, start, *done, hash))
+                        return NULL;
+                if (ret == 0)
+                        return backend;
+                if (ret < 0)
+                        break;
+        }
+
+        return NULL;
+}
+
+/**
+ * \brief Copies like <code>copy_span()</code>, in steps of
+ * <code>checkpoint_size</code> KiB with a checkpoint after each. Between
+ * two steps, the copy stops if the sync does. A step never starts with
+ * a reflink, which would clone the whole file.
+ *
+ * \param ckpt The checkpoints of the copy, NULL for none.
+ * \return The backend that finished, NULL on error.
+ */
+struct copy_backend *
+copy_resumable (struct copy_backend *backend, int fd_in, int fd_out, off_t end, off_t *done, struct xxh64 *hash,
+                struct checkpoint *ckpt)
+{
+        off_t step = checkpoint_size * Kb, mark;
+
+        if (ckpt == NULL)
+                return copy_span (backend, fd_in, fd_out, end, done, hash, 0);
+        if (backend->run == copy_reflink)
+                backend++;
+
+        for (;;)
+        {
+                mark = end - *done > step ? *done + step : end;
+                backend = copy_span (backend, fd_in, fd_out, mark, done, hash, ckpt->reread);
+                if (backend == NULL || *done < mark || *done >= end)
+                        return backend;
+                if (*done - ckpt->record.done >= step)
+                        checkpoint_save (ckpt, fd_out, *done, hash);
+                if (sync_cancelled ())
+                {
+                        errno = ECANCELED;
+                        return NULL;
+                }
+        }
+}
+
+/**
+ * \brief Finds the next range of data of <code>fd</code>, from <code>off</code>.
+ * A filesystem that can't tell gives everything up to <code>size</code>.
+ *
+ * \param start Gets the beginning of the data.
+ * \param end Gets the beginning of the hole after it.
+ * \return 0 if a range was found, 1 if only holes are left.
+ */
+int
+next_data (int fd, off_t off, off_t size, off_t *start, off_t *end)
+{
+        *start = lseek (fd, off, SEEK_DATA);
+        if (*start < 0)
+        {
+                if (errno == ENXIO)
+                        return 1;
+                *start = off;
+                *end = size;
+                return 0;
+        }
+
+        *end = lseek (fd, *start, SEEK_HOLE);
+        if (*end < 0 || *end > size)
+                *end = size;
+
+        return *start >= size;
+}
+
+/**
+ * \brief Copies the contents of <code>fd_in</code> to <code>fd_out</code>.
+ * A file with holes, fewer blocks than its length says, is copied one
+ * range of data at a time, found with <code>SEEK_DATA</code> and
+ * <code>SEEK_HOLE</code>; the holes are skipped, and stay holes on the
+ * copy. Only a reflink, which keeps the holes, is tried on the whole file.
+ * Files of <code>stream_size</code> KiB or more use
+ * <code>stream_backends</code>.
+ *
+ * \param fd_in File to be read.
+ * \param fd_out File to be written, empty or holding what
+ * <code>ckpt</code> says.
+ * \param meta Metadata of <code>fd_in</code>.
+ * \param moved Gets the bytes of data copied.
+ * \param hash Gets the whole file, holes as zeros, NULL for none. A
+ * resumed copy gives the hash of what it holds already.
+ * \param ckpt The checkpoints of a resumable copy, which starts where the
+ * last one was made; NULL for none.
+ * \return The name of the backend that finished the copy, NULL on error.
+ */
+const char *
+copy_data (int fd_in, int fd_out, const struct stat *meta, off_t *moved, struct xxh64 *hash, struct checkpoint *ckpt)
+{
+        off_t done = ckpt ? ckpt->record.done : 0, off, start, end, size = meta->st_size;
+        int ret;
+        const char *name = "holes";
+        struct copy_backend *backend = copy_backends;
+
+        if (stream_size > 0 && size >= stream_size * Kb)
+                backend = stream_backends;
+        *moved = size - done;
+        if ((off_t) meta->st_blocks * 512 >= size)
+                return (backend = copy_resumable (backend, fd_in, fd_out, size, &done, hash, ckpt)) ? backend->name : NULL;
+
+        /* The first backend is reflink, it can only clone the whole file, from 0. */
+        ret = ckpt ? 1 : backend->run (fd_in, fd_out, size, &done, hash);
+        if (ret == 0)
+                return backend->name;
+        if (ret < 0)
+                return NULL;
+        backend++;
+
+        *moved = 0;
+        for (off = done; off < size && !next_data (fd_in, off, size, &start, &end); off = end)
+        {
+                xxh64_zeros (hash, start - off);
+                done = start;
+                backend = copy_resumable (backend, fd_in, fd_out, end, &done, hash, ckpt);
+                if (backend == NULL)
+                        return NULL;
+                name = backend->name;
+                *moved += done - start;
+
+                /* The file was truncated while copying. */
+                if (done < end)
+                        return name;
+        }
+
+        /* The holes at the end. */
+        if (ftruncate (fd_out, size))
+                return NULL;
+        xxh64_zeros (hash, size - off);
+
+        return name;
+}
+
+/**
+ * \brief Updates <code>fd_out</code> to be equal to <code>fd_in</code>.
+ * Both files are read in blocks of <code>DELTA_BLOCK</code> bytes, at the
+ * same aligned offsets, and only the blocks that differ are written. The
+ * comparison is <code>memcmp()</code>, which glibc already runs on the
+ * widest vector unit of the machine.
+ *
+ * \param fd_in File to be read.
+ * \param fd_out File to be updated, open for reading and writing.
+ * \param off Where to start.
+ * \param size Where to stop.
+ * \param written Adds the bytes written.
+ * \param skipped Adds the bytes found equal, and not written.
+ * \param hash Gets the bytes of <code>fd_in</code>, NULL for none.
+ * \return Where it stopped, before <code>size</code> if <code>fd_in</code>
+ * got shorter, -1 on error.
+ */
+off_t
+copy_delta_span (int fd_in, int fd_out, off_t off, off_t size, off_t *written, off_t *skipped, struct xxh64 *hash)
+{
+        char *buf_in, *buf_out;
+        ssize_t rd_in, rd_out, pos, len;
+
+        if ((buf_in = copy_buf ()) == NULL)
+                return -1;
+        buf_out = buf_in + COPY_BUF;
+
+        while (off < size)
+        {
+                rd_in = pread_full (fd_in, buf_in, sched_take (size - off < COPY_BUF ? size - off : COPY_BUF), off);
+                if (rd_in < 0)
+                        return -1;
+                if (rd_in == 0)
+                        break;
+                rd_out = pread_full (fd_out, buf_out, rd_in, off);
+                if (rd_out < 0)
+                        return -1;
+                if (hash)
+                        xxh64_update (hash, buf_in, rd_in);
+
+                for (pos = 0; pos < rd_in; pos += len)
+                {
+                        len = rd_in - pos < DELTA_BLOCK ? rd_in - pos : DELTA_BLOCK;
+                        if (pos + len <= rd_out && !memcmp (buf_in + pos, buf_out + pos, len))
+                                *skipped += len;
+                        else if (pwrite_all (fd_out, buf_in + pos, len, off + pos))
+                                return -1;
+                        else
+                                *written += len;
+                }
+                off += rd_in;
+        }
+
+        return off;
+}
+
+/**
+ * \brief Updates <code>fd_out</code> to be equal to <code>fd_in</code>,
+ * writing only what differs, with <code>copy_delta_span()</code>.
+ * The holes of a sparse <code>fd_in</code> are punched in
+ * <code>fd_out</code> instead of compared; where that can't be done, the
+ * zeros are compared as data. At the end, <code>fd_out</code> is cut or
+ * extended to the length of <code>fd_in</code>.
+ *
+ * \param fd_in File to be read.
+ * \param fd_out File to be updated, open for reading and writing.
+ * \param meta Metadata of <code>fd_in</code>.
+ * \param written Gets the bytes written.
+ * \param skipped Gets the bytes found equal, and not written.
+ * \param hash Gets the whole of <code>fd_in</code>, holes as zeros, NULL
+ * for none.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+copy_delta (int fd_in, int fd_out, const struct stat *meta, off_t *written, off_t *skipped, struct xxh64 *hash)
+{
+        off_t off, start, end, reached = 0, size = meta->st_size;
+
+        *written = *skipped = 0;
+        if ((off_t) meta->st_blocks * 512 >= size)
+                reached = copy_delta_span (fd_in, fd_out, 0, size, written, skipped, hash);
+        else
+                for (off = 0; off < size; off = end)
+                {
+                        if (next_data (fd_in, off, size, &start, &end))
+                                start = end = size;
+                        if (start > off && fallocate (fd_out, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, start - off))
+                                start = off;
+                        xxh64_zeros (hash, start - off);
+
+                        reached = start < end ? copy_delta_span (fd_in, fd_out, start, end, written, skipped, hash) : end;
+                        if (reached < end)
+                                break;
+                }
+
+        if (reached < 0)
+                return -1;
+
+        return ftruncate (fd_out, reached);
+}
+
+/**
+ * \brief XXH64 of the first <code>size</code> bytes of <code>fd</code>.
+ * With <code>uncached</code>, what is in the page cache is written and
+ * dropped first, so the bytes come from the disk itself.
+ * \return The digest, 0 if the file can't be read whole.
+ */
+uint64_t
+file_digest (int fd, off_t size, int uncached)
+{
+        struct xxh64 state;
+
+        if (uncached && !fdatasync (fd))
+                posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+
+        xxh64_init (&state);
+        if (file_hash (fd, 0, size, &state))
+                return 0;
+
+        return xxh64_final (&state);
+}
+
+/**
+ * \def TMP_PREFIX
+ * Beginning of the hidden names of the files still being copied.
+ */
+#define TMP_PREFIX ".cpusb-"
+
+/**
+ * \def BATCH_FS
+ * Filesystems a batch of <code>durability</code> follows at once.
+ */
+#define BATCH_FS 8
+
+/**
+ * \struct batch_fs
+ * \brief The copies written to one filesystem since its last
+ * <code>syncfs()</code>, with a directory open on it.
+ */
+struct batch_fs
+{
+        dev_t dev;
+        int fd;
+        long files;
+        off_t bytes;
+};
+
+/**
+ * \struct durable_batch
+ * \brief The filesystems with copies not yet on the disk.
+ */
+struct durable_batch
+{
+        pthread_mutex_t lock;
+        int used;
+        struct batch_fs fs[BATCH_FS];
+};
+
+/**
+ * \var struct durable_batch batch
+ * The batch of this process.
+ */
+struct durable_batch batch = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * \brief Opens a new file in <code>dir_fd</code>, to take the place of
+ * another once complete. An <code>O_TMPFILE</code> has no name until
+ * then, so a crash leaves nothing behind; where the filesystem can't do
+ * it, the file gets a hidden name starting with <code>TMP_PREFIX</code>.
+ *
+ * \param tmp_name Gets the hidden name, "" for an <code>O_TMPFILE</code>.
+ * At least <code>NAME_MAX</code> + 1 bytes.
+ * \return The file descriptor, -1 on error.
+ */
+int
+tmp_open (int dir_fd, char *tmp_name)
+{
+        static unsigned long counter;
+        int fd;
+
+        tmp_name[0] = '\0';
+        fd = openat (dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd >= 0)
+                return fd;
+
+        snprintf (tmp_name, NAME_MAX + 1, TMP_PREFIX "%d-%lu", (int) getpid (),
+                  __atomic_add_fetch (&counter, 1, __ATOMIC_RELAXED));
+
+        return openat (dir_fd, tmp_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+}
+
+/**
+ * \brief Gives <code>fd</code>, from <code>tmp_open()</code>, a name in
+ * <code>dir_fd</code>.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+tmp_link (int fd, int dir_fd, const char *name)
+{
+        char proc[64];
+
+        /* Needs CAP_DAC_READ_SEARCH, /proc does not. */
+        if (!linkat (fd, "", dir_fd, name, AT_EMPTY_PATH))
+                return 0;
+        if (errno == EEXIST)
+                return -1;
+        snprintf (proc, sizeof (proc), "/proc/self/fd/%d", fd);
+
+        return linkat (AT_FDCWD, proc, dir_fd, name, AT_SYMLINK_FOLLOW);
+}
+
+/**
+ * \brief Puts the complete file <code>fd</code>, from <code>tmp_open()</code>,
+ * in place of <code>file</code>, at once. Whoever looks at
+ * <code>file</code> sees the old copy or the new one, never a part.
+ *
+ * \param tmp_name The name given by <code>tmp_open()</code>, cleared
+ * once there is nothing left to remove.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+tmp_commit (int dir_fd, int fd, char *tmp_name, const char *file)
+{
+        static unsigned long counter;
+
+        if (tmp_name[0] == '\0')
+        {
+                /* A new file needs no rename. */
+                if (!tmp_link (fd, dir_fd, file))
+                        return 0;
+                if (errno != EEXIST)
+                        return -1;
+
+                snprintf (tmp_name, NAME_MAX + 1, TMP_PREFIX "%d-l%lu", (int) getpid (),
+                          __atomic_add_fetch (&counter, 1, __ATOMIC_RELAXED));
+                if (tmp_link (fd, dir_fd, tmp_name))
+                {
+                        tmp_name[0] = '\0';
+                        return -1;
+                }
+        }
+
+        if (renameat (dir_fd, tmp_name, dir_fd, file))
+                return -1;
+        tmp_name[0] = '\0';
+
+        return 0;
+}
+
+/**
+ * \brief Flushes one filesystem of the batch. Must be called with
+ * <code>batch.lock</code> held.
+ */
+void
+batch_sync (struct batch_fs *fs)
+{
+        if ((fs->files || fs->bytes) && syncfs (fs->fd))
+                report ("Can't flush the copies to the disk", errno);
+        fs->files = 0;
+        fs->bytes = 0;
+}
+
+/**
+ * \brief Counts a copy of <code>bytes</code> made in <code>dir_fd</code>.
+ * With <code>durability</code> "batch", the filesystem is flushed with a
+ * single <code>syncfs()</code> after <code>batch_files</code> files or
+ * <code>batch_size</code> KiB, whichever comes first.
+ */
+void
+durable_count (int dir_fd, off_t bytes)
+{
+        int i;
+        struct batch_fs *fs = NULL;
+        struct stat sb;
+
+        if (durability != DURABLE_BATCH || fstat (dir_fd, &sb))
+                return;
+
+        pthread_mutex_lock (&batch.lock);
+        for (i = 0; i < batch.used && fs == NULL; i++)
+                if (batch.fs[i].dev == sb.st_dev)
+                        fs = &batch.fs[i];
+        if (fs == NULL && batch.used < BATCH_FS && (batch.fs[batch.used].fd = fcntl (dir_fd, F_DUPFD_CLOEXEC, 0)) >= 0)
+        {
+                fs = &batch.fs[batch.used++];
+                fs->dev = sb.st_dev;
+                fs->files = 0;
+                fs->bytes = 0;
+        }
+
+        if (fs)
+        {
+                fs->files++;
+                fs->bytes += bytes;
+                if ((batch_files > 0 && fs->files >= batch_files) ||
+                    (batch_size > 0 && fs->bytes >= batch_size * Kb))
+                        batch_sync (fs);
+        }
+        else if (syncfs (dir_fd))
+                report ("Can't flush the copies to the disk", errno);
+        pthread_mutex_unlock (&batch.lock);
+}
+
+/**
+ * \brief Flushes what is left of the batch, at the end of a sync.
+ */
+void
+durable_flush ()
+{
+        int i;
+
+        pthread_mutex_lock (&batch.lock);
+        for (i = 0; i < batch.used; i++)
+        {
+                batch_sync (&batch.fs[i]);
+                close (batch.fs[i].fd);
+        }
+        batch.used = 0;
+        pthread_mutex_unlock (&batch.lock);
+}
+
+/**
+ * \brief Starts a pass: the slots of the journal it uses get its mark.
+ */
+void
+journal_open ()
+{
+        journal_pass = now_us ();
+}
+
+/**
+ * \brief Closes the journal at the end of a pass. After a full pass, a
+ * partial copy it didn't go on with has lost its source, or was replaced:
+ * it is removed, with its slot. A journal left with no slot used is
+ * removed as well.
+ *
+ * \param full If the pass went through the whole tree.
+ */
+void
+journal_close (int full)
+{
+        int used = 0;
+        off_t off;
+        struct resume_record record;
+
+        if (journal_fd < 0 && full && journal_path)
+                journal_fd = open (journal_path, O_RDWR | O_CLOEXEC);
+        if (journal_fd < 0)
+                return;
+
+        for (off = 0; pread_full (journal_fd, (char *) &record, sizeof (struct resume_record), off) ==
+                     sizeof (struct resume_record); off += sizeof (struct resume_record))
+        {
+                if (record.key == 0)
+                        continue;
+                if (!full || record.pass == journal_pass)
+                {
+                        used = 1;
+                        continue;
+                }
+                record.path[PATH_MAX - 1] = '\0';
+                if (record.path[0] != '\0')
+                        unlink (record.path);
+                record.key = 0;
+                pwrite_all (journal_fd, (const char *) &record.key, sizeof (record.key), off);
+        }
+
+        close (journal_fd);
+        journal_fd = -1;
+        if (!used)
+                unlink (journal_path);
+}
+
+/**
+ * \brief Frees the slot of <code>ckpt</code>, once its copy is done or
+ * given up.
+ */
+void
+resume_close (struct checkpoint *ckpt)
+{
+        uint64_t key = 0;
+
+        if (pwrite_all (journal_fd, (const char *) &key, sizeof (key), ckpt->slot))
+                report ("Can't write the journal", errno);
+}
+
+/**
+ * \brief Opens the partial copy of <code>file</code>, to go on from its
+ * last checkpoint. It is a hidden file of <code>dir_src</code>, named
+ * after the source inode, the directory and <code>file</code>, so the
+ * next run finds it again. It goes on only if the source has the inode,
+ * size and modification time of the checkpoint, and the bytes of the
+ * copy still hash as they did; otherwise it starts again from 0.
+ *
+ * \param meta Metadata of the source.
+ * \param tmp_name Gets the name of the partial copy.
+ * \param ckpt Gets its slot of the journal, with the bytes done.
+ * \param hash Gets the hash of these bytes.
+ * \return The partial copy, open for reading and writing, -1 if the
+ * journal can't be used.
+ */
+int
+resume_open (int dir_src, const char *file, const struct stat *meta, char *tmp_name, struct checkpoint *ckpt,
+             struct xxh64 *hash)
+{
+        char proc[64], path[PATH_MAX];
+        int fd, found = 0;
+        off_t off, slot = -1;
+        ssize_t len;
+        struct resume_record *record = &ckpt->record;
+        struct stat sb;
+        struct xxh64 state;
+        uint64_t key;
+
+        if (fstat (dir_src, &sb))
+                return -1;
+        xxh64_init (&state);
+        xxh64_update (&state, &meta->st_ino, sizeof (meta->st_ino));
+        xxh64_update (&state, &sb.st_ino, sizeof (sb.st_ino));
+        xxh64_update (&state, file, strlen (file));
+        key = xxh64_final (&state);
+        if (key == 0)
+                key = 1;
+        snprintf (tmp_name, NAME_MAX + 1, TMP_PREFIX "r%016llx", (unsigned long long) key);
+
+        /* Where to remove it from, once its source is gone. */
+        snprintf (proc, sizeof (proc), "/proc/self/fd/%d", dir_src);
+        len = readlink (proc, path, PATH_MAX);
+        if (len < 0 || len >= PATH_MAX)
+                len = 0;
+        path[len] = '\0';
+
+        pthread_mutex_lock (&journal_lock);
+        if (journal_fd < 0 && journal_path)
+                journal_fd = open (journal_path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        for (off = 0; journal_fd >= 0 && pread_full (journal_fd, (char *) record, sizeof (struct resume_record), off) ==
+                     sizeof (struct resume_record); off += sizeof (struct resume_record))
+        {
+                if (record->key == key)
+                {
+                        found = 1;
+                        slot = off;
+                        break;
+                }
+                if (record->key == 0 && slot < 0)
+                        slot = off;
+        }
+        if (!found)
+        {
+                memset (record, 0, sizeof (struct resume_record));
+                record->key = key;
+        }
+        ckpt->slot = slot < 0 ? off : slot;
+        record->pass = journal_pass;
+        if (len == 0 || snprintf (record->path, PATH_MAX, "%s/%s", path, tmp_name) >= PATH_MAX)
+                record->path[0] = '\0';
+
+        /* The slot is taken before the lock is let go. */
+        if (journal_fd < 0 || pwrite_all (journal_fd, (const char *) record, sizeof (struct resume_record), ckpt->slot))
+        {
+                report ("Can't write the journal", errno);
+                pthread_mutex_unlock (&journal_lock);
+                return -1;
+        }
+        pthread_mutex_unlock (&journal_lock);
+
+        fd = openat (dir_src, tmp_name, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0)
+        {
+                resume_close (ckpt);
+                return -1;
+        }
+
+        state = record->state;
+        if (found && record->ino == meta->st_ino && record->size == meta->st_size &&
+            record->mtime == meta->st_mtim.tv_sec * 1000000000LL + meta->st_mtim.tv_nsec &&
+            record->done > 0 && record->done < meta->st_size && !fstat (fd, &sb) && sb.st_size >= record->done &&
+            file_digest (fd, record->done, 0) == xxh64_final (&state))
+        {
+                *hash = record->state;
+                return fd;
+        }
+
+        if (ftruncate (fd, 0))
+        {
+                close (fd);
+                resume_close (ckpt);
+                return -1;
+        }
+        record->ino = meta->st_ino;
+        record->size = meta->st_size;
+        record->mtime = meta->st_mtim.tv_sec * 1000000000LL + meta->st_mtim.tv_nsec;
+        record->done = 0;
+        xxh64_init (&record->state);
+        xxh64_init (hash);
+
+        return fd;
+}
+
+/**
+ * \brief Performs the copy between the device and source.
+ * Receiving a source and a destination directory, performs the copy in the 
+ * direction of the device to the source. The bytes go, by
+ * <code>copy_data()</code>, to a new file that takes the place of the
+ * target only once complete, so an interrupted copy never leaves a
+ * truncated file behind. With <code>in_place</code>, an existing target
+ * is updated by <code>copy_delta()</code> instead. The copy keeps the
+ * owner, mode and times of the original, and reaches the disk as
+ * <code>durability</code> says. Given <code>fd_clone</code>, a file known
+ * to hold the same bytes, the new file shares its extents instead, when
+ * the filesystem can. With <code>verify</code>, the bytes are hashed on
+ * their way, and in "readback" mode the copy is read again from the disk
+ * and must hash the same; the clones are not. A new file of
+ * <code>resume_size</code> KiB or more is copied with checkpoints in the
+ * journal: a copy cut short keeps its partial file, and the next one goes
+ * on from the last checkpoint, see <code>resume_open()</code>.
+ *
+ * \param dir_dev Open directory of origin file
+ * \param dir_src Open directory of copied file
+ * \param file File to be copied
+ * \param fd_clone Open file equal to <code>file</code>, -1 for none.
+ * \param digest Gets the XXH64 of the copy, 0 if not hashed. NULL to
+ * ignore it.
+ * \return 0 if copied, -1 otherwise.
+ **/
+int
+copy_from (int dir_dev, int dir_src, const char *file, int fd_clone, uint64_t *digest)
+{
+        char msg[MAX_INPUT], note[MAX_INPUT], tmp_name[NAME_MAX + 1] = "";
+        const char *method = NULL;
+        int fd_dev, fd_src = -1, fresh = 0, ret = -1;
+        long long start = now_us ();
+        off_t written, skipped, cloned = 0, resumed = 0;
+        struct checkpoint ckpt, *resume = NULL;
+        struct stat file_meta, dst_meta;
+        struct timespec times[2];
+        struct xxh64 state, *hash = NULL;
+        uint64_t sum = 0;
+
+        xxh64_init (&state);
+        if (verify_mode != VERIFY_OFF)
+                hash = &state;
+        if (digest)
+                *digest = 0;
+
+        fd_dev = openat (dir_dev, file, O_RDONLY | O_CLOEXEC);
+        if (fd_dev < 0)
+        {
+                snprintf (msg, MAX_INPUT, "Can't open %s", file);
+                report (msg, errno);
+                return -1;
+        }
+        fstat (fd_dev, &file_meta);
+        if (file_meta.st_size <= 0)
+        {
+                snprintf (msg, MAX_INPUT, "%s corrupted", file);
+                report (msg, errno);
+                close (fd_dev);
+                return -1;
+        }
+
+        if (in_place && fd_clone < 0)
+        {
+                fd_src = openat (dir_src, file, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+                if (fd_src >= 0 && (fstat (fd_src, &dst_meta) || !S_ISREG (dst_meta.st_mode)))
+                {
+                        close (fd_src);
+                        fd_src = -1;
+                }
+        }
+
+        if (fd_src >= 0)
+        {
+                if (!copy_delta (fd_dev, fd_src, &file_meta, &written, &skipped, hash))
+                {
+                        method = "in place";
+                        snprintf (note, MAX_INPUT, "%s updated in place, %lld bytes written, %lld bytes skipped",
+                                  file, (long long) written, (long long) skipped);
+                }
+        }
+        else
+        {
+                fresh = 1;
+                fd_src = tmp_open (dir_src, tmp_name);
+                /* A clone needs no checkpoint, it is tried first. */
+                if (fd_src >= 0 && fd_clone < 0 && resume_size > 0 && checkpoint_size > 0 &&
+                    file_meta.st_size >= resume_size * Kb &&
+                    (hash || copy_reflink (fd_dev, fd_src, file_meta.st_size, &cloned, NULL)))
+                {
+                        close (fd_src);
+                        if (tmp_name[0] != '\0')
+                                unlinkat (dir_src, tmp_name, 0);
+                        fd_src = resume_open (dir_src, file, &file_meta, tmp_name, &ckpt, &state);
+                        if (fd_src >= 0)
+                        {
+                                resume = &ckpt;
+                                resumed = ckpt.record.done;
+                                /* Without verify, the hash is only for the checkpoints. */
+                                ckpt.reread = hash == NULL;
+                                hash = &state;
+                        }
+                        else
+                                fd_src = tmp_open (dir_src, tmp_name);
+                }
+
+                if (fd_src >= 0 && fd_clone < 0 && cloned)
+                {
+                        method = "reflink";
+                        written = cloned;
+                        snprintf (note, MAX_INPUT, "%s copied with %s", file, method);
+                }
+                else if (fd_src >= 0 && fd_clone >= 0 && !copy_reflink (fd_clone, fd_src, file_meta.st_size, &cloned, NULL))
+                {
+                        method = "dedup";
+                        hash = NULL;
+                        written = 0;
+                        __atomic_add_fetch (&metrics.bytes_deduped, file_meta.st_size, __ATOMIC_RELAXED);
+                        snprintf (note, MAX_INPUT, "%s shares the blocks of an identical file", file);
+                }
+                else if (fd_src >= 0 && (method = copy_data (fd_dev, fd_src, &file_meta, &written, hash, resume)))
+                {
+                        if (resumed)
+                                snprintf (note, MAX_INPUT, "%s copied with %s, resumed at %lld bytes", file, method,
+                                          (long long) resumed);
+                        else
+                                snprintf (note, MAX_INPUT, "%s copied with %s", file, method);
+                }
+        }
+
+        if (fd_src < 0)
+        {
+                snprintf (msg, MAX_INPUT, "Can't open %s", file);
+                report (msg, errno);
+        }
+        else if (method == NULL)
+        {
+                snprintf (msg, MAX_INPUT, "Error copying %s", file);
+                report (msg, errno);
+        }
+        else if (hash && (sum = xxh64_final (hash)) && verify_mode == VERIFY_READBACK &&
+                 file_digest (fd_src, hash->total, 1) != sum)
+        {
+                snprintf (msg, MAX_INPUT, "The copy of %s reads back wrong", file);
+                report (msg, EIO);
+                __atomic_add_fetch (&metrics.verify_failures, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+                if (fchown (fd_src, file_meta.st_uid, file_meta.st_gid))
+                {
+                        snprintf (msg, MAX_INPUT, "Can't change the ownwership of %s", file);
+                        report (msg, errno);
+                }
+                if (fchmod (fd_src, file_meta.st_mode))
+                {
+                        snprintf (msg, MAX_INPUT, "Can't change the permissions of %s", file);
+                        report (msg, errno);
+                }
+
+                /* Same times on both sides, so cmp_stat() finds them in sync. */
+                times[0] = file_meta.st_atim;
+                times[1] = file_meta.st_mtim;
+                if (futimens (fd_src, times))
+                {
+                        snprintf (msg, MAX_INPUT, "Can't change the times of %s", file);
+                        report (msg, errno);
+                }
+
+                if (durability == DURABLE_FILE && fsync (fd_src))
+                {
+                        snprintf (msg, MAX_INPUT, "Can't flush %s to the disk", file);
+                        report (msg, errno);
+                }
+                else if (fresh && tmp_commit (dir_src, fd_src, tmp_name, file))
+                {
+                        snprintf (msg, MAX_INPUT, "Can't put the copy of %s in place", file);
+                        report (msg, errno);
+                }
+                else
+                {
+                        /* The new name must reach the disk as well. */
+                        if (durability == DURABLE_FILE && fresh && fsync (dir_src))
+                                report ("Can't flush a directory to the disk", errno);
+                        durable_count (dir_src, written);
+
+                        report (note, 0);
+                        __atomic_add_fetch (&metrics.bytes_copied, written, __ATOMIC_RELAXED);
+                        __atomic_add_fetch (&metrics.files_copied, 1, __ATOMIC_RELAXED);
+                        __atomic_add_fetch (&metrics.bytes_resumed, resumed, __ATOMIC_RELAXED);
+                        hist_record (&metrics.copy_time, now_us () - start);
+                        if (digest)
+                                *digest = sum;
+                        ret = 0;
+                }
+        }
+
+        /* A copy cut short waits for the next run, from its last checkpoint. */
+        if (resume && method == NULL && ckpt.record.done > 0)
+                tmp_name[0] = '\0';
+        else if (resume)
+                resume_close (resume);
+        if (tmp_name[0] != '\0')
+                unlinkat (dir_src, tmp_name, 0);
+        if (fd_src >= 0)
+                close (fd_src);
+        close (fd_dev);
+
+        return ret;
+}
+
+/**
+ * \brief Copies <code>file</code> with <code>copy_from()</code>, from
+ * the device to the source.
+ *
+ * \param dir_dev Open directory of origin file
+ * \param dir_src Open directory of copied file
+ * \param file File to be copied
+ * \return 0 if copied, -1 otherwise.
+ */
+int
+copy (int dir_dev, int dir_src, const char *file)
+{
+        return copy_from (dir_dev, dir_src, file, -1, NULL);
+}
+
+/**
+ * \struct linux_dirent64
+ * \brief A record of <code>getdents64</code>, as the kernel writes it.
+ */
+struct linux_dirent64
+{
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+};
+
+/**
+ * \struct scan_entry
+ * \brief A name of a <code>dir_scan</code>.
+ * <code>name</code> is an offset into the names of the scan, so they can
+ * grow without moving the entries. <code>type</code> is a
+ * <code>DT_</code> constant, <code>DT_UNKNOWN</code> only if the scan
+ * wasn't asked to resolve it, or the name went away meanwhile.
+ */
+struct scan_entry
+{
+        uint64_t ino;
+        uint32_t name;
+        unsigned char type;
+};
+
+/**
+ * \struct dir_scan
+ * \brief The names of a directory, read at once, sorted.
+ * Two arrays and no allocation per name: the entries, and all the names
+ * one after the other, each ending in a zero.
+ */
+struct dir_scan
+{
+        struct scan_entry *entries;
+        size_t used;
+        size_t alloc;
+        char *names;
+        size_t names_len;
+        size_t names_alloc;
+};
+
+/**
+ * \var pthread_key_t scan_buf_key
+ * The buffers of <code>scan_buf()</code>, one per thread.
+ */
+pthread_key_t scan_buf_key;
+
+/**
+ * \brief Creates <code>scan_buf_key</code>, the buffer is freed with its thread.
+ */
+void
+scan_buf_init ()
+{
+        pthread_key_create (&scan_buf_key, free);
+}
+
+/**
+ * \brief Gives the buffer of <code>SCAN_BUF</code> bytes of the calling
+ * thread, for <code>getdents64</code>, allocated once and reused for
+ * every directory.
+ * \return The buffer, NULL if there is no memory.
+ */
+char *
+scan_buf ()
+{
+        static pthread_once_t once = PTHREAD_ONCE_INIT;
+        char *buf;
+
+        pthread_once (&once, scan_buf_init);
+        buf = pthread_getspecific (scan_buf_key);
+        if (buf == NULL)
+        {
+                buf = malloc (SCAN_BUF);
+                if (buf == NULL)
+                        return NULL;
+                pthread_setspecific (scan_buf_key, buf);
+        }
+
+        return buf;
+}
+
+/**
+ * \brief Name of the entry <code>i</code> of <code>scan</code>.
+ */
+const char *
+scan_name (const struct dir_scan *scan, size_t i)
+{
+        return scan->names + scan->entries[i].name;
+}
+
+/**
+ * \brief Appends <code>name</code> to <code>scan</code>.
+ */
+void
+scan_add (struct dir_scan *scan, const char *name, unsigned char type, uint64_t ino)
+{
+        size_t len = strlen (name) + 1;
+        struct scan_entry *entries;
+        char *names;
+
+        if (scan->used == scan->alloc)
+        {
+                scan->alloc = scan->alloc ? scan->alloc * 2 : 64;
+                entries = realloc (scan->entries, scan->alloc * sizeof (struct scan_entry));
+                if (entries == NULL)
+                        fatal ("Can't allocate a directory scan", errno);
+                scan->entries = entries;
+        }
+        if (scan->names_len + len > scan->names_alloc)
+        {
+                while (scan->names_len + len > scan->names_alloc)
+                        scan->names_alloc = scan->names_alloc ? scan->names_alloc * 2 : 4096;
+                names = realloc (scan->names, scan->names_alloc);
+                if (names == NULL)
+                        fatal ("Can't allocate a directory scan", errno);
+                scan->names = names;
+        }
+
+        memcpy (scan->names + scan->names_len, name, len);
+        scan->entries[scan->used].ino = ino;
+        scan->entries[scan->used].name = scan->names_len;
+        scan->entries[scan->used].type = type;
+        scan->names_len += len;
+        scan->used++;
+}
+
+/**
+ * \brief Orders two entries of a scan by name, for <code>qsort_r()</code>.
+ */
+int
+scan_cmp (const void *a, const void *b, void *names)
+{
+        return strcmp ((char *) names + ((const struct scan_entry *) a)->name,
+                       (char *) names + ((const struct scan_entry *) b)->name);
+}
+
+/**
+ * \brief Reads the names of <code>dir_fd</code> into <code>scan</code>.
+ * The directory is read with <code>getdents64</code>, as many entries at
+ * a time as <code>SCAN_BUF</code> holds, from a new descriptor, so the
+ * offset of <code>dir_fd</code> doesn't move. Some filesystems don't tell
+ * the type of the entries; with <code>resolve</code>, those are stat'ed
+ * once the whole directory is read, one after the other in the order of
+ * the directory. "." and "..", and the names of <code>TMP_PREFIX</code>,
+ * are left out, and the entries are sorted by name.
+ *
+ * \param dir_fd An open directory.
+ * \param scan Gets the entries, to be released by
+ * <code>dir_scan_free()</code>, even on error.
+ * \param resolve True to find the type of <code>DT_UNKNOWN</code> entries.
+ * \return 0 on success, -1 if the directory can't be read.
+ */
+int
+dir_scan_read (int dir_fd, struct dir_scan *scan, int resolve)
+{
+        char *buf;
+        int fd;
+        long rd, pos;
+        size_t i;
+        struct linux_dirent64 *d;
+        struct stat sb;
+
+        memset (scan, 0, sizeof (struct dir_scan));
+        if ((buf = scan_buf ()) == NULL)
+                return -1;
+        fd = openat (dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+
+        while ((rd = syscall (SYS_getdents64, fd, buf, SCAN_BUF)) > 0)
+                for (pos = 0; pos < rd; pos += d->d_reclen)
+                {
+                        d = (struct linux_dirent64 *) (buf + pos);
+                        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+                                continue;
+                        /* Copies under way, or waiting to be resumed, are not synced. */
+                        if (!strncmp (d->d_name, TMP_PREFIX, sizeof (TMP_PREFIX) - 1))
+                                continue;
+                        scan_add (scan, d->d_name, d->d_type, d->d_ino);
+                }
+
+        for (i = 0; resolve && rd == 0 && i < scan->used; i++)
+                if (scan->entries[i].type == DT_UNKNOWN && !fstatat (fd, scan_name (scan, i), &sb, AT_SYMLINK_NOFOLLOW))
+                        scan->entries[i].type = IFTODT (sb.st_mode);
+        close (fd);
+        if (rd < 0)
+                return -1;
+
+        if (scan->used > 1)
+                qsort_r (scan->entries, scan->used, sizeof (struct scan_entry), scan_cmp, scan->names);
+
+        return 0;
+}
+
+/**
+ * \brief Releases the arrays of <code>scan</code>.
+ */
+void
+dir_scan_free (struct dir_scan *scan)
+{
+        free (scan->entries);
+        free (scan->names);
+        memset (scan, 0, sizeof (struct dir_scan));
+}
+
+/**
+ * \struct dir_entry
+ * \brief A name in a <code>dir_index</code>, with its metadata.
+ */
+struct dir_entry
+{
+        const char *name;
+        struct stat meta;
+};
+
+/**
+ * \struct dir_index
+ * \brief Snapshot of a directory, read only once.
+ * Open addressing hash table, with linear probing, of the names in the
+ * directory, which stay in <code>scan</code>. <code>size</code> is a
+ * power of two, at least twice the names, so the probes stay short.
+ */
+struct dir_index
+{
+        size_t size;
+        struct dir_entry *slots;
+        struct dir_scan scan;
+};
+
+/**
+ * \brief FNV-1a hash of <code>name</code>.
+ */
+size_t
+dir_index_hash (const char *name)
+{
+        size_t hash = 2166136261u;
+
+        while (*name)
+        {
+                hash ^= (unsigned char) *name++;
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+/**
+ * \brief Finds the slot of <code>name</code>.
+ * \return The slot holding <code>name</code>, or the empty one where it
+ * should be put.
+ */
+struct dir_entry *
+dir_index_slot (struct dir_entry *slots, size_t size, const char *name)
+{
+        size_t i = dir_index_hash (name) & (size - 1);
+
+        while (slots[i].name && strcmp (slots[i].name, name))
+                i = (i + 1) & (size - 1);
+
+        return &slots[i];
+}
+
+/**
+ * \brief Releases <code>index</code> and all its names.
+ */
+void
+dir_index_free (struct dir_index *index)
+{
+        if (index == NULL)
+                return;
+
+        dir_scan_free (&index->scan);
+        free (index->slots);
+        free (index);
+}
+
+/**
+ * \brief Reads <code>dir_fd</code> into a new <code>dir_index</code>.
+ * The directory is read once, by <code>dir_scan_read()</code>, and each
+ * file is stat'ed once, relative to <code>dir_fd</code>. Entries the
+ * kernel says are not regular files are kept with empty metadata, as
+ * nobody compares them. A directory that can't be read gives an empty
+ * index, as if it had no files.
+ *
+ * \param dir_fd Open directory to be read.
+ * \return The index, to be released by <code>dir_index_free()</code>.
+ */
+struct dir_index *
+dir_index_load (int dir_fd)
+{
+        const char *name;
+        size_t i;
+        struct dir_entry *slot;
+        struct dir_index *index;
+
+        index = calloc (1, sizeof (struct dir_index));
+        if (index == NULL)
+                fatal ("Can't allocate the directory index", errno);
+        /* The types are looked at below, with the stat of the files. */
+        if (dir_scan_read (dir_fd, &index->scan, 0))
+                dir_scan_free (&index->scan);
+
+        for (index->size = 64; index->size < index->scan.used * 2; index->size *= 2)
+                ;
+        index->slots = calloc (index->size, sizeof (struct dir_entry));
+        if (index->slots == NULL)
+                fatal ("Can't allocate the directory index", errno);
+
+        for (i = 0; i < index->scan.used; i++)
+        {
+                name = scan_name (&index->scan, i);
+                slot = dir_index_slot (index->slots, index->size, name);
+                slot->name = name;
+                if ((index->scan.entries[i].type != DT_REG && index->scan.entries[i].type != DT_UNKNOWN) ||
+                    fstatat (dir_fd, name, &slot->meta, AT_SYMLINK_NOFOLLOW))
+                        memset (&slot->meta, 0, sizeof (struct stat));
+        }
+
+        return index;
+}
+
+/**
+ * \brief Search a <code>file</code> in <code>index</code>.
+ * Costs one hash, no matter how big the directory is.
+ *
+ * \param index Snapshot of the directory for search.
+ * \param file Name of file which will be search.
+ * \return The entry of <code>file</code>, NULL if it is not found.
+ */
+struct dir_entry *
+find_file (const struct dir_index *index, const char *file)
+{
+        struct dir_entry *slot;
+
+        slot = dir_index_slot (index->slots, index->size, file);
+
+        return slot->name ? slot : NULL;
+}
+
+/**
+ * \brief Modification time of <code>meta</code>, in nanoseconds.
+ */
+int64_t
+mtime_ns (const struct stat *meta)
+{
+        return meta->st_mtim.tv_sec * 1000000000LL + meta->st_mtim.tv_nsec;
+}
+
+/**
+ * \brief Change time of <code>meta</code>, in nanoseconds.
+ */
+int64_t
+ctime_ns (const struct stat *meta)
+{
+        return meta->st_ctim.tv_sec * 1000000000LL + meta->st_ctim.tv_nsec;
+}
+
+/**
+ * \brief Sets <code>mtime_window</code> for the trees at
+ * <code>from_fd</code> and <code>to_fd</code>, from
+ * <code>modify_window</code> or, if -1, from their filesystems. FAT keeps
+ * the modification time to 2 seconds, and exFAT through the Linux driver
+ * too.
+ */
+void
+window_set (int from_fd, int to_fd)
+{
+        struct statfs fs;
+        int fds[2] = { from_fd, to_fd }, i;
+
+        mtime_window = (long long) modify_window * 1000000;
+        for (i = 0; modify_window < 0 && i < 2; i++)
+                if (!fstatfs (fds[i], &fs) && (fs.f_type == MSDOS_SUPER_MAGIC || fs.f_type == EXFAT_SUPER_MAGIC))
+                        mtime_window = 2000000000LL;
+        if (mtime_window < 0)
+                mtime_window = 0;
+}
+
+/**
+ * \brief Compare the modification time of two files, to the nanosecond.
+ * Only the metadata already at hand is used, no file is opened.
+ * <code>copy()</code> gives the copy the time of the original, so files in
+ * sync have the same time, or times less than <code>mtime_window</code>
+ * apart where a filesystem rounds them. With the same time and different
+ * sizes, the one on the <i>device</i> wins.
+ *
+ * \param file_meta_dev Metadata of the file on <i>device</i>
+ * \param file_meta_src Metadata of the same file on <i>source</i>
+ * \return Positive if the file on <i>device</i> is the newest, negative if
+ * the one on <i>source</i> is, 0 if they are in sync.
+ */
+int
+cmp_stat (const struct stat *file_meta_dev, const struct stat *file_meta_src)
+{
+        long long diff = mtime_ns (file_meta_dev) - mtime_ns (file_meta_src);
+
+        if (diff != 0 && (diff >= mtime_window || diff <= -mtime_window))
+                return diff > 0 ? 1 : -1;
+
+        return file_meta_dev->st_size != file_meta_src->st_size;
+}
+
+/**
+ * \def MANIFEST_MAGIC
+ * First bytes of a manifest file, with its version.
+ */
+#define MANIFEST_MAGIC "CPUSBMF2"
+
+/**
+ * \def MANIFEST_FILE
+ * Type of the record of a file, with the metadata of the device copy.
+ *
+ * \def MANIFEST_DIR
+ * Type of the record of a directory, with the metadata of the source copy.
+ *
+ * \def MANIFEST_COPY
+ * Type of the second record of a file, with the metadata of the source
+ * copy.
+ */
+#define MANIFEST_FILE 1
+#define MANIFEST_DIR 2
+#define MANIFEST_COPY 3
+
+/**
+ * \struct manifest_header
+ * \brief Beginning of the manifest file.
+ * It is followed by <code>slots</code> records, an open addressing hash
+ * table of paths, and by <code>names</code> bytes of paths.
+ */
+struct manifest_header
+{
+        char magic[8];
+        uint64_t slots;
+        uint64_t count;
+        uint64_t names;
+};
+
+/**
+ * \struct manifest_record
+ * \brief What a path was like at the end of the last full pass.
+ * <code>hash</code> is never 0 in a used slot, <code>path</code> and
+ * <code>len</code> point into the names. <code>digest</code> is a hash of
+ * the contents, 0 if unknown.
+ */
+struct manifest_record
+{
+        uint64_t hash;
+        uint64_t path;
+        uint64_t ino;
+        int64_t size;
+        int64_t mtime;
+        int64_t ctime;
+        uint64_t digest;
+        uint32_t type;
+        uint32_t len;
+};
+
+/**
+ * \struct manifest
+ * \brief The last manifest, mapped, and the next one, being built.
+ * The mapped one is only read, by any thread. The records of the next one
+ * are appended under <code>lock</code> and hashed when it is written.
+ */
+struct manifest
+{
+        void *map;
+        size_t map_len;
+        const struct manifest_record *slots;
+        uint64_t size;
+        const char *names;
+        uint64_t names_len;
+
+        int active;
+        pthread_mutex_t lock;
+        struct manifest_record *records;
+        size_t used, alloc;
+        char *next_names;
+        size_t names_used, names_alloc;
+};
+
+/**
+ * \var struct manifest manifest
+ * The manifest of the sync pair, only used by full passes.
+ */
+struct manifest manifest;
+
+/**
+ * \brief 64 bits FNV-1a hash of <code>path</code>, never 0.
+ */
+uint64_t
+manifest_hash (const char *path)
+{
+        uint64_t hash = 14695981039346656037ULL;
+
+        while (*path)
+        {
+                hash ^= (unsigned char) *path++;
+                hash *= 1099511628211ULL;
+        }
+
+        return hash ? hash : 1;
+}
+
+/**
+ * \brief Maps the manifest of the last full pass and starts the next one.
+ * A missing or damaged manifest is just ignored, the pass then checks
+ * every path.
+ */
+void
+manifest_open ()
+{
+        int fd;
+        struct stat sb;
+        const struct manifest_header *header;
+
+        if (!use_manifest || manifest_path == NULL)
+                return;
+
+        pthread_mutex_init (&manifest.lock, NULL);
+        manifest.active = 1;
+
+        fd = open (manifest_path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return;
+
+        if (!fstat (fd, &sb) && sb.st_size >= (off_t) sizeof (struct manifest_header))
+        {
+                manifest.map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (manifest.map == MAP_FAILED)
+                        manifest.map = NULL;
+                else
+                {
+                        manifest.map_len = sb.st_size;
+                        header = manifest.map;
+                        if (!memcmp (header->magic, MANIFEST_MAGIC, 8) &&
+                            header->slots && !(header->slots & (header->slots - 1)) &&
+                            header->slots <= sb.st_size / sizeof (struct manifest_record) &&
+                            sizeof (struct manifest_header) + header->slots * sizeof (struct manifest_record) + header->names <= (uint64_t) sb.st_size)
+                        {
+                                manifest.slots = (const struct manifest_record *) (header + 1);
+                                manifest.size = header->slots;
+                                manifest.names = (const char *) (manifest.slots + header->slots);
+                                manifest.names_len = header->names;
+                        }
+                        else
+                                report ("Ignoring a damaged manifest", 0);
+                }
+        }
+        close (fd);
+}
+
+/**
+ * \brief Finds the record of <code>path</code> in the last manifest.
+ * \return The record, NULL if there is none.
+ */
+const struct manifest_record *
+manifest_find (const char *path, uint32_t type)
+{
+        size_t len;
+        uint64_t hash, i, n;
+        const struct manifest_record *slot;
+
+        if (manifest.slots == NULL)
+                return NULL;
+
+        hash = manifest_hash (path);
+        len = strlen (path);
+
+        for (i = hash & (manifest.size - 1), n = 0; n < manifest.size; i = (i + 1) & (manifest.size - 1), n++)
+        {
+                slot = &manifest.slots[i];
+                if (slot->hash == 0)
+                        break;
+                if (slot->hash == hash && slot->type == type && slot->len == len &&
+                    slot->path + len <= manifest.names_len &&
+                    !memcmp (manifest.names + slot->path, path, len))
+                        return slot;
+        }
+
+        return NULL;
+}
+
+/**
+ * \brief Tells if <code>meta</code> is still as in <code>record</code>.
+ * Size and modification time always count, the inode and the change time
+ * as <code>check_inode</code> and <code>check_ctime</code> say.
+ */
+int
+manifest_match (const struct manifest_record *record, const struct stat *meta)
+{
+        return record->size == meta->st_size &&
+               record->mtime == mtime_ns (meta) &&
+               (!check_inode || record->ino == (uint64_t) meta->st_ino) &&
+               (!check_ctime || record->ctime == ctime_ns (meta));
+}
+
+/**
+ * \brief Adds <code>path</code> to the next manifest.
+ *
+ * \param path Path relative to the tops of the pair.
+ * \param type <code>MANIFEST_FILE</code> or <code>MANIFEST_DIR</code>.
+ * \param meta Metadata to be remembered.
+ * \param digest Hash of the contents, 0 if unknown.
+ */
+void
+manifest_add (const char *path, uint32_t type, const struct stat *meta, uint64_t digest)
+{
+        char *names;
+        size_t len, alloc;
+        struct manifest_record *record, *records;
+
+        if (!manifest.active)
+                return;
+
+        len = strlen (path);
+
+        pthread_mutex_lock (&manifest.lock);
+        if (manifest.used == manifest.alloc)
+        {
+                alloc = manifest.alloc ? manifest.alloc * 2 : 1024;
+                records = realloc (manifest.records, alloc * sizeof (struct manifest_record));
+                if (records == NULL)
+                        fatal ("Can't allocate the manifest", errno);
+                manifest.records = records;
+                manifest.alloc = alloc;
+        }
+        if (manifest.names_used + len > manifest.names_alloc)
+        {
+                for (alloc = manifest.names_alloc ? manifest.names_alloc : 64 * Kb; alloc < manifest.names_used + len; alloc *= 2)
+                        ;
+                names = realloc (manifest.next_names, alloc);
+                if (names == NULL)
+                        fatal ("Can't allocate the manifest", errno);
+                manifest.next_names = names;
+                manifest.names_alloc = alloc;
+        }
+
+        record = &manifest.records[manifest.used++];
+        record->hash = manifest_hash (path);
+        record->path = manifest.names_used;
+        record->len = len;
+        record->type = type;
+        record->ino = meta->st_ino;
+        record->size = meta->st_size;
+        record->mtime = mtime_ns (meta);
+        record->ctime = ctime_ns (meta);
+        record->digest = digest;
+        memcpy (manifest.next_names + manifest.names_used, path, len);
+        manifest.names_used += len;
+        pthread_mutex_unlock (&manifest.lock);
+}
+
+/**
+ * \brief Writes the next manifest in place of the last one.
+ * It is written aside and renamed, so a crash leaves one or the other.
+ */
+void
+manifest_write ()
+{
+        char tmp_path[PATH_MAX];
+        int fd, ok;
+        size_t i;
+        uint64_t j, slots = 64;
+        struct manifest_header header;
+        struct manifest_record *table;
+
+        while (slots < manifest.used * 2)
+                slots *= 2;
+        table = calloc (slots, sizeof (struct manifest_record));
+        if (table == NULL)
+        {
+                report ("Can't allocate the manifest", errno);
+                return;
+        }
+        for (i = 0; i < manifest.used; i++)
+        {
+                for (j = manifest.records[i].hash & (slots - 1); table[j].hash; j = (j + 1) & (slots - 1))
+                        ;
+                table[j] = manifest.records[i];
+        }
+
+        memset (&header, 0, sizeof (struct manifest_header));
+        memcpy (header.magic, MANIFEST_MAGIC, 8);
+        header.slots = slots;
+        header.count = manifest.used;
+        header.names = manifest.names_used;
+
+        snprintf (tmp_path, PATH_MAX, "%s.tmp", manifest_path);
+        fd = open (tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd < 0)
+        {
+                report ("Can't write the manifest", errno);
+                free (table);
+                return;
+        }
+        ok = !write_all (fd, &header, sizeof (struct manifest_header)) &&
+             !write_all (fd, table, slots * sizeof (struct manifest_record)) &&
+             !write_all (fd, manifest.next_names, manifest.names_used);
+        if (close (fd))
+                ok = 0;
+
+        if (!ok || rename (tmp_path, manifest_path))
+        {
+                report ("Can't write the manifest", errno);
+                unlink (tmp_path);
+        }
+        free (table);
+}
+
+/**
+ * \brief Ends the use of the manifest.
+ *
+ * \param save If true, the next manifest replaces the last one.
+ */
+void
+manifest_close (int save)
+{
+        if (!manifest.active)
+                return;
+
+        if (save)
+                manifest_write ();
+
+        if (manifest.map)
+                munmap (manifest.map, manifest.map_len);
+        free (manifest.records);
+        free (manifest.next_names);
+        pthread_mutex_destroy (&manifest.lock);
+        memset (&manifest, 0, sizeof (struct manifest));
+}
+
+int read_dir (int from_fd, int to_fd, const char *rel);
+
+/**
+ * \def DEDUP_MAGIC
+ * First bytes of the dedup index, with its version.
+ */
+#define DEDUP_MAGIC "CPUSBDD1"
+
+/**
+ * \def DEDUP_MIN
+ * Files smaller than this are always copied, a link saves nothing.
+ */
+#define DEDUP_MIN (4 * Kb)
+
+/**
+ * \struct dedup_record
+ * \brief An entry of the dedup index file, followed by <code>len</code>
+ * bytes of path.
+ */
+struct dedup_record
+{
+        int64_t size;
+        int64_t mtime;
+        uint64_t digest;
+        uint32_t len;
+};
+
+/**
+ * \brief First slot of the files of <code>size</code> bytes.
+ */
+size_t
+dedup_first (const struct dedup_index *index, int64_t size)
+{
+        return ((uint64_t) size * 11400714819323198485ULL) & (index->size - 1);
+}
+
+/**
+ * \brief Remembers that <code>path</code>, of the source tree, has
+ * <code>size</code> bytes and was modified at <code>mtime</code>.
+ * A path already known is updated; its digest is kept as long as it
+ * still describes the file. Must be called with <code>index->lock</code>
+ * held.
+ *
+ * \param digest XXH64 of the contents, 0 if unknown.
+ */
+void
+dedup_put (struct dedup_index *index, const char *path, int64_t size, int64_t mtime, uint64_t digest)
+{
+        size_t i, j, old_size = index->size;
+        struct dedup_entry *old = index->slots, *entry;
+
+        if (size < DEDUP_MIN)
+                return;
+
+        /* Grown, the stale entries are left behind. */
+        if ((index->used + 1) * 2 > index->size)
+        {
+                index->size = old_size ? old_size * 2 : 1024;
+                index->slots = calloc (index->size, sizeof (struct dedup_entry));
+                if (index->slots == NULL)
+                        fatal ("Can't allocate the dedup index", errno);
+                index->used = 0;
+                for (i = 0; i < old_size; i++)
+                {
+                        if (old[i].path == NULL)
+                                continue;
+                        if (old[i].size < 0)
+                        {
+                                free (old[i].path);
+                                continue;
+                        }
+                        for (j = dedup_first (index, old[i].size); index->slots[j].path; j = (j + 1) & (index->size - 1))
+                                ;
+                        index->slots[j] = old[i];
+                        index->used++;
+                }
+                free (old);
+        }
+
+        for (i = dedup_first (index, size); index->slots[i].path; i = (i + 1) & (index->size - 1))
+        {
+                entry = &index->slots[i];
+                if (entry->size != size || strcmp (entry->path, path))
+                        continue;
+                if (entry->mtime != mtime || digest)
+                {
+                        entry->mtime = mtime;
+                        entry->digest = digest;
+                        index->changed = 1;
+                }
+                return;
+        }
+
+        entry = &index->slots[i];
+        entry->path = strdup (path);
+        if (entry->path == NULL)
+                return;
+        entry->size = size;
+        entry->mtime = mtime;
+        entry->digest = digest;
+        index->used++;
+        index->changed = 1;
+}
+
+/**
+ * \brief Remembers <code>path</code> as it is now, described by
+ * <code>meta</code>, in the index of the pair being synced.
+ */
+void
+dedup_add (const char *path, const struct stat *meta)
+{
+        if (dedup_mode == DEDUP_OFF || dedup == NULL || dedup->root_fd < 0 || !S_ISREG (meta->st_mode))
+                return;
+
+        pthread_mutex_lock (&dedup->lock);
+        dedup_put (dedup, path, meta->st_size, mtime_ns (meta), 0);
+        pthread_mutex_unlock (&dedup->lock);
+}
+
+/**
+ * \brief Reads the index of the pair being synced from
+ * <code>dedup_path</code>, the first time, and keeps
+ * <code>root_fd</code>, the top of its source tree, until
+ * <code>dedup_close()</code>.
+ */
+void
+dedup_open (int root_fd)
+{
+        char path[PATH_MAX];
+        FILE *file;
+        struct dedup_record record;
+
+        if (dedup_mode == DEDUP_OFF || dedup == NULL)
+                return;
+
+        pthread_mutex_lock (&dedup->lock);
+        dedup->root_fd = root_fd;
+        if (!dedup->loaded && dedup_path && (file = fopen (dedup_path, "re")))
+        {
+                if (fread (path, 1, sizeof (DEDUP_MAGIC) - 1, file) == sizeof (DEDUP_MAGIC) - 1 &&
+                    !memcmp (path, DEDUP_MAGIC, sizeof (DEDUP_MAGIC) - 1))
+                        while (fread (&record, sizeof (record), 1, file) == 1 && record.len < PATH_MAX &&
+                               fread (path, 1, record.len, file) == record.len)
+                        {
+                                path[record.len] = '\0';
+                                dedup_put (dedup, path, record.size, record.mtime, record.digest);
+                        }
+                fclose (file);
+                dedup->changed = 0;
+        }
+        dedup->loaded = 1;
+        pthread_mutex_unlock (&dedup->lock);
+}
+
+/**
+ * \brief Writes the index of the pair being synced, if it changed, to
+ * <code>dedup_path</code>, through a temporary file renamed over it.
+ */
+void
+dedup_close ()
+{
+        char tmp_path[PATH_MAX];
+        int ok = 1;
+        size_t i;
+        FILE *file;
+        struct dedup_record record;
+
+        if (dedup_mode == DEDUP_OFF || dedup == NULL)
+                return;
+
+        pthread_mutex_lock (&dedup->lock);
+        dedup->root_fd = -1;
+        if (dedup->changed && dedup_path && !dry_run)
+        {
+                snprintf (tmp_path, PATH_MAX, "%s.tmp", dedup_path);
+                file = fopen (tmp_path, "we");
+                if (file == NULL)
+                        report ("Can't write the dedup index", errno);
+                else
+                {
+                        ok = fwrite (DEDUP_MAGIC, 1, sizeof (DEDUP_MAGIC) - 1, file) == sizeof (DEDUP_MAGIC) - 1;
+                        for (i = 0; ok && i < dedup->size; i++)
+                        {
+                                if (dedup->slots[i].path == NULL || dedup->slots[i].size < 0)
+                                        continue;
+                                memset (&record, 0, sizeof (record));
+                                record.size = dedup->slots[i].size;
+                                record.mtime = dedup->slots[i].mtime;
+                                record.digest = dedup->slots[i].digest;
+                                record.len = strlen (dedup->slots[i].path);
+                                ok = fwrite (&record, sizeof (record), 1, file) == 1 &&
+                                     fwrite (dedup->slots[i].path, 1, record.len, file) == record.len;
+                        }
+                        if (fclose (file))
+                                ok = 0;
+                        if (!ok || rename (tmp_path, dedup_path))
+                        {
+                                report ("Can't write the dedup index", errno);
+                                unlink (tmp_path);
+                        }
+                        else
+                                dedup->changed = 0;
+                }
+        }
+        pthread_mutex_unlock (&dedup->lock);
+}
+
+/**
+ * \brief Makes <code>file</code> in <code>to_fd</code> a hard link of
+ * <code>path</code>, of the source tree, in place of what was there.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+dedup_link (const char *path, int to_fd, const char *file)
+{
+        static unsigned long counter;
+        char tmp_name[NAME_MAX + 1];
+
+        snprintf (tmp_name, sizeof (tmp_name), TMP_PREFIX "%d-h%lu", (int) getpid (),
+                  __atomic_add_fetch (&counter, 1, __ATOMIC_RELAXED));
+        if (linkat (dedup->root_fd, path, to_fd, tmp_name, 0))
+                return -1;
+        if (renameat (to_fd, tmp_name, to_fd, file))
+        {
+                unlinkat (to_fd, tmp_name, 0);
+                return -1;
+        }
+        /* A rename between two links of the same file does nothing. */
+        unlinkat (to_fd, tmp_name, 0);
+
+        if (durability == DURABLE_FILE)
+                fsync (to_fd);
+        durable_count (to_fd, 0);
+
+        return 0;
+}
+
+/**
+ * \brief Finds the entry of <code>path</code> in <code>index</code>, if
+ * it still has <code>size</code> and <code>mtime</code>. Called under
+ * the lock of the index.
+ * \return The entry, NULL if it is gone or changed.
+ */
+struct dedup_entry *
+dedup_find (struct dedup_index *index, const char *path, int64_t size, int64_t mtime)
+{
+        size_t i;
+
+        for (i = index->size ? dedup_first (index, size) : 0; index->size && index->slots[i].path;
+             i = (i + 1) & (index->size - 1))
+                if (index->slots[i].size == size && index->slots[i].mtime == mtime && !strcmp (index->slots[i].path, path))
+                        return &index->slots[i];
+
+        return NULL;
+}
+
+/**
+ * \brief Copies <code>file</code>, from the device to the source, unless
+ * the source already holds an identical file somewhere. The index is
+ * searched by size first; only when a file of the same size is there are
+ * both hashed, with XXH64. A match becomes a hard link or a reflink of
+ * the one found, as <code>dedup</code> says, and the bytes are not copied
+ * again. The files of the same size are copied out of the index, and read
+ * without its lock: two workers may hash the same file, but none waits on
+ * the other's read.
+ *
+ * \param from_fd Open directory of the device file.
+ * \param to_fd Open directory of the source copy.
+ * \param file Name of the file.
+ * \param path Path of the file, relative to the tops of the pair.
+ * \param copied Gets the XXH64 of the file, 0 if unknown. NULL to ignore
+ * it.
+ * \return The result of <code>copy_from()</code>, 0 if linked.
+ */
+int
+dedup_copy (int from_fd, int to_fd, const char *file, const char *path, uint64_t *copied)
+{
+        char match[PATH_MAX], msg[MAX_INPUT + PATH_MAX];
+        int fd, fd_match, ret, found = 0, linkable = 0;
+        size_t i, n = 0, alloc = 0;
+        uint64_t digest = 0, sum = 0;
+        struct dedup_entry *entry, *cand, *cands = NULL;
+        struct stat meta, sb;
+
+        if (dedup_mode == DEDUP_OFF || dedup == NULL || dedup->root_fd < 0)
+                return copy_from (from_fd, to_fd, file, -1, copied);
+
+        fd = openat (from_fd, file, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+                return copy_from (from_fd, to_fd, file, -1, copied);
+        if (fstat (fd, &meta) || meta.st_size < DEDUP_MIN)
+        {
+                close (fd);
+                return copy_from (from_fd, to_fd, file, -1, copied);
+        }
+
+        /* Only the copy out is under the lock, the reads are not. */
+        pthread_mutex_lock (&dedup->lock);
+        for (i = dedup->size ? dedup_first (dedup, meta.st_size) : 0; dedup->size && dedup->slots[i].path;
+             i = (i + 1) & (dedup->size - 1))
+        {
+                entry = &dedup->slots[i];
+                if (entry->size != meta.st_size || !strcmp (entry->path, path))
+                        continue;
+                if (n == alloc)
+                {
+                        alloc = alloc ? alloc * 2 : 8;
+                        cand = realloc (cands, alloc * sizeof (struct dedup_entry));
+                        if (cand == NULL)
+                                break;
+                        cands = cand;
+                }
+                cands[n] = *entry;
+                if ((cands[n].path = strdup (entry->path)))
+                        n++;
+        }
+        pthread_mutex_unlock (&dedup->lock);
+
+        for (i = 0; i < n && !linkable && !(found && dedup_mode != DEDUP_HARDLINK); i++)
+        {
+                cand = &cands[i];
+
+                /* Changed or gone since it was indexed. */
+                if (fstatat (dedup->root_fd, cand->path, &sb, AT_SYMLINK_NOFOLLOW) || !S_ISREG (sb.st_mode) ||
+                    sb.st_size != cand->size || mtime_ns (&sb) != cand->mtime)
+                {
+                        pthread_mutex_lock (&dedup->lock);
+                        if ((entry = dedup_find (dedup, cand->path, cand->size, cand->mtime)))
+                        {
+                                entry->size = -1;
+                                dedup->changed = 1;
+                        }
+                        pthread_mutex_unlock (&dedup->lock);
+                        continue;
+                }
+
+                if (cand->digest == 0 && (fd_match = openat (dedup->root_fd, cand->path, O_RDONLY | O_CLOEXEC)) >= 0)
+                {
+                        cand->digest = file_digest (fd_match, cand->size, 0);
+                        close (fd_match);
+                        pthread_mutex_lock (&dedup->lock);
+                        if (cand->digest && (entry = dedup_find (dedup, cand->path, cand->size, cand->mtime)))
+                        {
+                                entry->digest = cand->digest;
+                                dedup->changed = 1;
+                        }
+                        pthread_mutex_unlock (&dedup->lock);
+                }
+                if (digest == 0)
+                        digest = file_digest (fd, meta.st_size, 0);
+
+                if (digest == 0 || cand->digest != digest)
+                        continue;
+
+                /* A hard link shares the metadata too, it must be the same already. */
+                if (dedup_mode == DEDUP_HARDLINK && sb.st_mode == meta.st_mode && sb.st_uid == meta.st_uid &&
+                    sb.st_gid == meta.st_gid && !cmp_stat (&meta, &sb))
+                        linkable = 1;
+                if (linkable || !found)
+                        snprintf (match, PATH_MAX, "%s", cand->path);
+                found = 1;
+        }
+        for (i = 0; i < n; i++)
+                free (cands[i].path);
+        free (cands);
+        close (fd);
+
+        ret = -1;
+        if (linkable && !dedup_link (match, to_fd, file))
+        {
+                snprintf (msg, sizeof (msg), "%s linked to %s", file, match);
+                report (msg, 0);
+                __atomic_add_fetch (&metrics.bytes_deduped, meta.st_size, __ATOMIC_RELAXED);
+                ret = 0;
+        }
+        else if (found && (fd_match = openat (dedup->root_fd, match, O_RDONLY | O_CLOEXEC)) >= 0)
+        {
+                ret = copy_from (from_fd, to_fd, file, fd_match, &sum);
+                close (fd_match);
+        }
+        else
+                ret = copy_from (from_fd, to_fd, file, -1, &sum);
+        if (sum)
+                digest = sum;
+        if (copied)
+                *copied = ret == 0 ? digest : 0;
+
+        if (ret == 0 && !fstatat (to_fd, file, &sb, AT_SYMLINK_NOFOLLOW))
+        {
+                pthread_mutex_lock (&dedup->lock);
+                dedup_put (dedup, path, sb.st_size, mtime_ns (&sb),
+                           sb.st_size == meta.st_size && mtime_ns (&sb) == mtime_ns (&meta) ? digest : 0);
+                pthread_mutex_unlock (&dedup->lock);
+        }
+
+        return ret;
+}
+
+/**
+ * \brief Reads <code>file</code> of <code>dir_fd</code> from the disk,
+ * and compares it to <code>digest</code>.
+ * \return 0 if it matches, -1 otherwise.
+ */
+int
+verify_stored (int dir_fd, const char *file, uint64_t digest)
+{
+        int fd, ret;
+        struct stat meta;
+
+        fd = openat (dir_fd, file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+                return -1;
+        ret = !fstat (fd, &meta) && file_digest (fd, meta.st_size, 1) == digest ? 0 : -1;
+        close (fd);
+
+        return ret;
+}
+
+/**
+ * \brief Tells if <code>meta_to</code>, the destination copy of
+ * <code>path</code>, is as the manifest remembers. An edit in place
+ * changes the file, but not the time of its directory.
+ */
+int
+copy_known (const char *path, const struct stat *meta_to)
+{
+        const struct manifest_record *record;
+
+        record = manifest_find (path, MANIFEST_COPY);
+
+        return record && meta_to && manifest_match (record, meta_to);
+}
+
+/**
+ * \brief Remembers the copy of <code>file</code> in <code>to_fd</code>,
+ * the destination of <code>path</code>, in the next manifest.
+ *
+ * \param meta_to Its metadata, NULL to look it up.
+ */
+void
+copy_done (int to_fd, const char *file, const char *path, const struct stat *meta_to)
+{
+        struct stat sb;
+
+        if (!manifest.active || (meta_to == NULL && fstatat (to_fd, file, &sb, 0)))
+                return;
+        manifest_add (path, MANIFEST_COPY, meta_to ? meta_to : &sb, 0);
+}
+
+/**
+ * \brief Synchronizes one regular <code>file</code>.
+ * If the file exists on both sides, copies from the newest to the oldest,
+ * otherwise copies it from <code>from_fd</code>. When the destination
+ * directory didn't change since the last full pass, and both copies of
+ * the file are as the manifest remembers, nothing is copied, unless
+ * <code>verify</code> is "stored": then a copy in sync is read and
+ * compared to the hash the manifest has of it, and copied again if it
+ * changed behind the filesystem's back.
+ *
+ * \param from_fd Directory where the file was found.
+ * \param to_fd The other directory.
+ * \param file Name of the file.
+ * \param path Path of the file, relative to the tops of the pair.
+ * \param meta_to Metadata of the file in <code>to_fd</code>, NULL if it
+ * doesn't exist there or is not known yet.
+ * \param known True if <code>to_fd</code> didn't change since the last
+ * manifest, <code>meta_to</code> is then looked up here.
+ * \return The result of <code>copy()</code>, 0 if nothing was copied.
+ */
+int
+sync_file (int from_fd, int to_fd, const char *file, const char *path, const struct stat *meta_to, int known)
+{
+        char msg[MAX_INPUT + PATH_MAX];
+        int ret, newer;
+        uint64_t digest = 0;
+        struct stat meta_from, meta_dst;
+        const struct manifest_record *record;
+
+        if (fstatat (from_fd, file, &meta_from, 0))
+                return copy (from_fd, to_fd, file);
+
+        record = manifest_find (path, MANIFEST_FILE);
+        if (record && !manifest_match (record, &meta_from))
+                record = NULL;
+        if (record)
+                digest = record->digest;
+
+        if (known)
+        {
+                meta_to = fstatat (to_fd, file, &meta_dst, 0) ? NULL : &meta_dst;
+                if (record && copy_known (path, meta_to) && (verify_mode != VERIFY_STORED || digest == 0))
+                {
+                        manifest_add (path, MANIFEST_FILE, &meta_from, digest);
+                        copy_done (to_fd, file, path, meta_to);
+                        dedup_add (path, &meta_from);
+                        return 0;
+                }
+        }
+
+        newer = meta_to ? cmp_stat (&meta_from, meta_to) : 1;
+        if (newer == 0 && digest && verify_mode == VERIFY_STORED && verify_stored (to_fd, file, digest))
+        {
+                snprintf (msg, sizeof (msg), "The copy of %s changed on the disk, copying it again", path);
+                report (msg, EIO);
+                __atomic_add_fetch (&metrics.verify_failures, 1, __ATOMIC_RELAXED);
+                newer = 1;
+        }
+
+        if (newer > 0)
+                ret = dedup_copy (from_fd, to_fd, file, path, &digest);
+        else if (newer < 0)
+        {
+                ret = copy_from (to_fd, from_fd, file, -1, &digest);
+                if (ret == 0)
+                        fstatat (from_fd, file, &meta_from, 0);
+        }
+        else
+                ret = 0;
+
+        if (ret == 0)
+        {
+                manifest_add (path, MANIFEST_FILE, &meta_from, digest);
+                copy_done (to_fd, file, path, newer == 0 ? meta_to : NULL);
+        }
+        /* dedup_copy() indexed its own copies. */
+        if (ret == 0 && newer <= 0)
+                dedup_add (path, &meta_from);
+
+        return ret;
+}
+
+/**
+ * \brief Tells if <code>to_fd</code> is as the manifest remembers.
+ * A directory whose entries were not created, removed nor renamed keeps
+ * its modification time.
+ *
+ * \param to_fd The destination directory.
+ * \param rel Path of the directory, relative to the top of the pair.
+ */
+int
+dir_known (int to_fd, const char *rel)
+{
+        struct stat sb;
+        const struct manifest_record *record;
+
+        record = manifest_find (rel, MANIFEST_DIR);
+
+        return record && !fstat (to_fd, &sb) && manifest_match (record, &sb);
+}
+
+/**
+ * \brief Remembers <code>to_fd</code> in the next manifest.
+ * Called after everything inside the directory was synced.
+ */
+void
+dir_done (int to_fd, const char *rel)
+{
+        struct stat sb;
+
+        if (manifest.active && !fstat (to_fd, &sb))
+                manifest_add (rel, MANIFEST_DIR, &sb, 0);
+}
+
+/**
+ * \brief Opens the subdirectory <code>dir</code> on both sides.
+ * The copy keeps the mode and owner of the original.
+ *
+ * \param from_fd Directory where <code>dir</code> was found.
+ * \param to_fd The other directory, <code>dir</code> is created there.
+ * \param dir Name of the subdirectory.
+ * \param sub_from Gets <code>dir</code> in <code>from_fd</code>.
+ * \param sub_to Gets <code>dir</code> in <code>to_fd</code>.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+open_subdir (int from_fd, int to_fd, const char *dir, int *sub_from, int *sub_to)
+{
+        struct stat sb;
+
+        *sub_from = openat (from_fd, dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (*sub_from < 0)
+                return -1;
+
+        fstat (*sub_from, &sb);
+        *sub_to = open_dir (to_fd, dir, sb.st_mode & 07777, sb.st_uid, sb.st_gid);
+        if (*sub_to < 0)
+        {
+                close (*sub_from);
+                return -1;
+        }
+
+        return 0;
+}
+
+/**
+ * \brief Synchronizes the subdirectory <code>dir</code>, recursively.
+ *
+ * \param from_fd Directory where <code>dir</code> was found.
+ * \param to_fd The other directory, <code>dir</code> is created there.
+ * \param dir Name of the subdirectory.
+ * \param path Path of <code>dir</code>, relative to the tops of the pair.
+ * \return The result of <code>read_dir()</code>, -1 on error.
+ */
+int
+sync_subdir (int from_fd, int to_fd, const char *dir, const char *path)
+{
+        int sub_from, sub_to, ret;
+
+        if (open_subdir (from_fd, to_fd, dir, &sub_from, &sub_to))
+                return -1;
+
+        ret = read_dir (sub_from, sub_to, path);
+        close (sub_to);
+        close (sub_from);
+
+        return ret;
+}
+
+/**
+ * \brief Reads the <code>from_fd</code>, for coping your contents.
+ * Open <code>from_fd</code>, make a search, taking each file or directory,
+ * For each file or directory, try to find on other location, between device and
+ * source directory. Look to your content and do copy from the newest to the oldest.
+ * The other location is read only once, into a <code>dir_index</code>,
+ * and not at all if the manifest says it didn't change.
+ * Everything is relative to the two open directories, so the walk neither
+ * changes nor depends on the current directory.
+ * 
+ * \param from_fd Origin location, generally the device directory.
+ * \param to_fd Destination folder, generally the source directory.
+ * \param rel Path of both, relative to the tops of the pair.
+ * \return 0 on success, -1 if <code>from_fd</code> can't be read.
+ */
+int
+read_dir (int from_fd, int to_fd, const char *rel)
+{
+        char path[PATH_MAX];
+        const char *name;
+        int known;
+        size_t i;
+        struct dir_entry *found;
+        struct dir_index *index = NULL;
+        struct dir_scan scan;
+
+        if (dir_scan_read (from_fd, &scan, 1))
+        {
+                report ("Can't read a directory", errno);
+                dir_scan_free (&scan);
+                return -1;
+        }
+        known = dir_known (to_fd, rel);
+        if (!known)
+                index = dir_index_load (to_fd);
+
+        for (i = 0; i < scan.used && !sync_cancelled (); i++)
+        {
+                name = scan_name (&scan, i);
+                if (join_path (path, rel, name))
+                        continue;
+
+                if (scan.entries[i].type == DT_DIR)
+                        sync_subdir (from_fd, to_fd, name, path);
+                else if (scan.entries[i].type == DT_REG)
+                {
+                        found = index ? find_file (index, name) : NULL;
+                        sync_file (from_fd, to_fd, name, path, found ? &found->meta : NULL, known);
+                }
+        }
+        dir_scan_free (&scan);
+        dir_index_free (index);
+        dir_done (to_fd, rel);
+
+        return 0;
+}
+
+/**
+ * \struct dir_pair
+ * \brief A directory open on both sides, shared by the tasks inside it.
+ * The descriptors are closed, and the directory is remembered in the
+ * manifest, when the last reference is released.
+ */
+struct dir_pair
+{
+        int from_fd;
+        int to_fd;
+        int refs;
+        int known;
+        char *rel;
+};
+
+/**
+ * \struct task
+ * \brief One piece of work of a parallel sync pass.
+ * Without <code>name</code>, reads the directory <code>pair</code>,
+ * otherwise synchronizes the file <code>name</code> inside it.
+ */
+struct task
+{
+        struct dir_pair *pair;
+        char *name;
+        int has_meta;
+        struct stat meta_to;
+};
+
+struct sync_pool;
+
+/**
+ * \struct worker
+ * \brief A thread of the pool, with its own deque of tasks.
+ * The owner pushes and pops at the tail, so it goes deep first and keeps
+ * its directories hot. The others steal from the head, where the oldest
+ * tasks, usually whole directories, are.
+ */
+struct worker
+{
+        struct sync_pool *pool;
+        int id;
+        pthread_t thread;
+        pthread_mutex_t lock;
+        size_t head, tail, size;
+        struct task *tasks;
+};
+
+/**
+ * \struct sync_pool
+ * \brief The workers of a parallel sync pass.
+ * <code>pending</code> counts the tasks queued or running, the pass is
+ * over when it reaches zero.
+ */
+struct sync_pool
+{
+        int n;
+        struct worker *workers;
+        long pending;
+        int idle;
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+};
+
+/**
+ * \brief Makes a <code>dir_pair</code> owning both descriptors.
+ */
+struct dir_pair *
+pair_new (int from_fd, int to_fd, const char *rel)
+{
+        struct dir_pair *pair;
+
+        pair = malloc (sizeof (struct dir_pair));
+        if (pair == NULL)
+                fatal ("Can't allocate a task", errno);
+        pair->from_fd = from_fd;
+        pair->to_fd = to_fd;
+        pair->refs = 1;
+        pair->known = 0;
+        pair->rel = strdup (rel);
+        if (pair->rel == NULL)
+                fatal ("Can't allocate a task", errno);
+
+        return pair;
+}
+
+/**
+ * \brief Releases one reference of <code>pair</code>.
+ */
+void
+pair_release (struct dir_pair *pair)
+{
+        if (__atomic_sub_fetch (&pair->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+                dir_done (pair->to_fd, pair->rel);
+                free (pair->rel);
+                close (pair->from_fd);
+                close (pair->to_fd);
+                free (pair);
+        }
+}
+
+/**
+ * \brief Queues <code>task</code> at the tail of the deque of <code>self</code>.
+ */
+void
+pool_push (struct worker *self, const struct task *task)
+{
+        size_t i, size;
+        struct sync_pool *pool = self->pool;
+        struct task *tasks;
+
+        __atomic_add_fetch (&pool->pending, 1, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch (&metrics.queued, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock (&self->lock);
+        if (self->tail - self->head == self->size)
+        {
+                size = self->size ? self->size * 2 : 256;
+                tasks = malloc (size * sizeof (struct task));
+                if (tasks == NULL)
+                        fatal ("Can't allocate a task", errno);
+                for (i = self->head; i < self->tail; i++)
+                        tasks[i - self->head] = self->tasks[i % self->size];
+                free (self->tasks);
+                self->tasks = tasks;
+                self->tail -= self->head;
+                self->head = 0;
+                self->size = size;
+        }
+        self->tasks[self->tail++ % self->size] = *task;
+        pthread_mutex_unlock (&self->lock);
+
+        if (__atomic_load_n (&pool->idle, __ATOMIC_ACQUIRE))
+                pthread_cond_signal (&pool->cond);
+}
+
+/**
+ * \brief Takes a task from the tail of <code>self</code>, or from the head
+ * of another worker.
+ * \return 1 if <code>task</code> was filled, 0 if there is no work.
+ */
+int
+pool_take (struct worker *self, struct task *task)
+{
+        int i, found = 0;
+        struct sync_pool *pool = self->pool;
+        struct worker *victim;
+
+        pthread_mutex_lock (&self->lock);
+        if (self->tail > self->head)
+        {
+                *task = self->tasks[--self->tail % self->size];
+                found = 1;
+        }
+        pthread_mutex_unlock (&self->lock);
+
+        for (i = 1; !found && i < pool->n; i++)
+        {
+                victim = &pool->workers[(self->id + i) % pool->n];
+                pthread_mutex_lock (&victim->lock);
+                if (victim->tail > victim->head)
+                {
+                        *task = victim->tasks[victim->head++ % victim->size];
+                        found = 1;
+                }
+                pthread_mutex_unlock (&victim->lock);
+        }
+        if (found)
+                __atomic_sub_fetch (&metrics.queued, 1, __ATOMIC_RELAXED);
+
+        return found;
+}
+
+/**
+ * \brief Reads the directory of <code>pair</code>, queuing its contents.
+ * The parallel version of <code>read_dir()</code>: each subdirectory and
+ * each file becomes a task, instead of being synced right away.
+ */
+void
+scan_dir (struct worker *self, struct dir_pair *pair)
+{
+        char path[PATH_MAX];
+        const char *name;
+        int sub_from, sub_to;
+        size_t i;
+        struct dir_entry *found;
+        struct dir_index *index = NULL;
+        struct dir_scan scan;
+        struct task task;
+
+        if (dir_scan_read (pair->from_fd, &scan, 1))
+        {
+                report ("Can't read a directory", errno);
+                dir_scan_free (&scan);
+                return;
+        }
+        pair->known = dir_known (pair->to_fd, pair->rel);
+        if (!pair->known)
+                index = dir_index_load (pair->to_fd);
+
+        for (i = 0; i < scan.used && !sync_cancelled (); i++)
+        {
+                memset (&task, 0, sizeof (struct task));
+                name = scan_name (&scan, i);
+
+                if (scan.entries[i].type == DT_DIR)
+                {
+                        if (join_path (path, pair->rel, name) ||
+                            open_subdir (pair->from_fd, pair->to_fd, name, &sub_from, &sub_to))
+                                continue;
+                        task.pair = pair_new (sub_from, sub_to, path);
+                        pool_push (self, &task);
+                }
+                else if (scan.entries[i].type == DT_REG)
+                {
+                        found = index ? find_file (index, name) : NULL;
+                        if (found)
+                        {
+                                task.has_meta = 1;
+                                task.meta_to = found->meta;
+                        }
+                        task.name = strdup (name);
+                        task.pair = pair;
+                        __atomic_add_fetch (&pair->refs, 1, __ATOMIC_ACQ_REL);
+                        pool_push (self, &task);
+                }
+        }
+        dir_scan_free (&scan);
+        dir_index_free (index);
+}
+
+/**
+ * \brief Runs tasks until the pass is over.
+ */
+void *
+pool_work (void *arg)
+{
+        char path[PATH_MAX];
+        struct worker *self = arg;
+        struct sync_pool *pool = self->pool;
+        struct task task;
+        struct timespec ts;
+
+        for (;;)
+        {
+                if (pool_take (self, &task))
+                {
+                        if (task.name)
+                        {
+                                if (!sync_cancelled () && !join_path (path, task.pair->rel, task.name))
+                                        sync_file (task.pair->from_fd, task.pair->to_fd, task.name, path,
+                                                   task.has_meta ? &task.meta_to : NULL, task.pair->known);
+                                free (task.name);
+                        }
+                        else
+                                scan_dir (self, task.pair);
+                        pair_release (task.pair);
+
+                        /* The last task wakes everybody to leave. */
+                        if (__atomic_sub_fetch (&pool->pending, 1, __ATOMIC_ACQ_REL) == 0)
+                                pthread_cond_broadcast (&pool->cond);
+                        continue;
+                }
+
+                if (__atomic_load_n (&pool->pending, __ATOMIC_ACQUIRE) == 0)
+                        break;
+
+                /* Others are still scanning, wait a bit for new tasks. */
+                pthread_mutex_lock (&pool->lock);
+                pool->idle++;
+                if (__atomic_load_n (&pool->pending, __ATOMIC_ACQUIRE))
+                {
+                        clock_gettime (CLOCK_REALTIME, &ts);
+                        ts.tv_nsec += 1000000;
+                        if (ts.tv_nsec >= 1000000000)
+                        {
+                                ts.tv_sec++;
+                                ts.tv_nsec -= 1000000000;
+                        }
+                        pthread_cond_timedwait (&pool->cond, &pool->lock, &ts);
+                }
+                pool->idle--;
+                pthread_mutex_unlock (&pool->lock);
+        }
+
+        return NULL;
+}
+
+/**
+ * \brief Synchronizes the trees at <code>from_fd</code> and <code>to_fd</code>.
+ * With more than one of <code>workers</code>, the pass is split in tasks
+ * run by a pool of threads, the calling one included. Otherwise it is
+ * just <code>read_dir()</code>. Both give the same result. The time of
+ * the pass goes to <code>metrics.scan_time</code>.
+ *
+ * \param from_fd Origin location, generally the device directory.
+ * \param to_fd Destination folder, generally the source directory.
+ * \param rel Path of both, relative to the tops of the pair.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+sync_tree (int from_fd, int to_fd, const char *rel)
+{
+        int i, n, sub_from, sub_to, ret;
+        long long start = now_us ();
+        struct sync_pool pool;
+        struct task task;
+
+        if (workers <= 1)
+        {
+                ret = read_dir (from_fd, to_fd, rel);
+                hist_record (&metrics.scan_time, now_us () - start);
+                return ret;
+        }
+
+        /* The root tasks owns its descriptors, like any other. */
+        sub_from = openat (from_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        sub_to = openat (to_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sub_from < 0 || sub_to < 0)
+        {
+                if (sub_from >= 0)
+                        close (sub_from);
+                if (sub_to >= 0)
+                        close (sub_to);
+                return -1;
+        }
+
+        n = workers;
+        memset (&pool, 0, sizeof (struct sync_pool));
+        pool.n = n;
+        pool.workers = calloc (n, sizeof (struct worker));
+        if (pool.workers == NULL)
+                fatal ("Can't allocate the workers", errno);
+        pthread_mutex_init (&pool.lock, NULL);
+        pthread_cond_init (&pool.cond, NULL);
+        for (i = 0; i < n; i++)
+        {
+                pool.workers[i].pool = &pool;
+                pool.workers[i].id = i;
+                pthread_mutex_init (&pool.workers[i].lock, NULL);
+        }
+
+        memset (&task, 0, sizeof (struct task));
+        task.pair = pair_new (sub_from, sub_to, rel);
+        pool_push (&pool.workers[0], &task);
+
+        /* If a thread can't start, the others do its part. */
+        for (i = 1; i < n; i++)
+                if (pthread_create (&pool.workers[i].thread, NULL, pool_work, &pool.workers[i]))
+                {
+                        report ("Can't start a worker", errno);
+                        pool.workers[i].thread = 0;
+                }
+        pool_work (&pool.workers[0]);
+        for (i = 1; i < n; i++)
+                if (pool.workers[i].thread)
+                        pthread_join (pool.workers[i].thread, NULL);
+
+        for (i = 0; i < n; i++)
+        {
+                pthread_mutex_destroy (&pool.workers[i].lock);
+                free (pool.workers[i].tasks);
+        }
+        pthread_cond_destroy (&pool.cond);
+        pthread_mutex_destroy (&pool.lock);
+        free (pool.workers);
+        hist_record (&metrics.scan_time, now_us () - start);
+
+        return 0;
+}
+
+/**
+ * \brief Opens <code>rel</code> on both sides.
+ * Walks <code>rel</code> from <code>from_root</code> and
+ * <code>to_root</code> at the same time, creating on the destination the
+ * directories that are still missing, as <code>sync_subdir()</code> does.
+ *
+ * \param from_root Top of the origin tree.
+ * \param to_root Top of the destination tree.
+ * \param rel Path relative to both tops, "" for the tops themselves.
+ * \param from_fd Gets the directory <code>rel</code> of origin.
+ * \param to_fd Gets the directory <code>rel</code> of destination.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+open_mirror (int from_root, int to_root, const char *rel, int *from_fd, int *to_fd)
+{
+        char buf[PATH_MAX], *name, *save;
+        int from, to, next;
+        struct stat sb;
+
+        if (snprintf (buf, PATH_MAX, "%s", rel) >= PATH_MAX)
+                return -1;
+
+        from = openat (from_root, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        to = openat (to_root, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        for (name = strtok_r (buf, "/", &save); name && from >= 0 && to >= 0; name = strtok_r (NULL, "/", &save))
+        {
+                next = openat (from, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                close (from);
+                from = next;
+                if (from < 0)
+                        break;
+
+                fstat (from, &sb);
+                next = open_dir (to, name, sb.st_mode & 07777, sb.st_uid, sb.st_gid);
+                close (to);
+                to = next;
+        }
+
+        if (from < 0 || to < 0)
+        {
+                if (from >= 0)
+                        close (from);
+                if (to >= 0)
+                        close (to);
+                return -1;
+        }
+
+        *from_fd = from;
+        *to_fd = to;
+
+        return 0;
+}
+
+/**
+ * \def PLAN_EXTENT_MIN
+ * Files of a plan this large are ordered by their first physical extent,
+ * smaller ones by inode.
+ */
+#define PLAN_EXTENT_MIN (1024 * Kb)
+
+/**
+ * \enum plan_op
+ * \brief What an entry of a <code>sync_plan</code> does.
+ */
+enum plan_op
+{
+        PLAN_MKDIR,
+        PLAN_COPY,
+        PLAN_ATTR
+};
+
+/**
+ * \struct plan_entry
+ * \brief One step of a <code>sync_plan</code>.
+ * <code>path</code> is relative to the tops of the pair, its first
+ * <code>dir_len</code> bytes name the directory. A copy goes from the
+ * origin to the destination, or the other way when <code>reverse</code>.
+ * <code>far</code> tells that <code>key</code> is a physical offset, not
+ * an inode.
+ */
+struct plan_entry
+{
+        char *path;
+        size_t dir_len;
+        int op;
+        int reverse;
+        int far;
+        uint64_t key;
+        off_t size;
+        mode_t mode;
+        uid_t uid;
+        gid_t gid;
+};
+
+/**
+ * \struct sync_plan
+ * \brief Everything a pass would do, found before doing any of it.
+ * <code>dirs</code> holds every directory walked, to be remembered in the
+ * manifest once the plan has run, and <code>bytes</code> the bytes to be
+ * copied each way.
+ */
+struct sync_plan
+{
+        size_t used, alloc;
+        struct plan_entry *entries;
+        size_t dirs_used, dirs_alloc;
+        char **dirs;
+        off_t bytes[2];
+};
+
+/**
+ * \brief Appends an entry for <code>path</code> to <code>plan</code>.
+ * \return The new entry, with the rest to be filled.
+ */
+struct plan_entry *
+plan_add (struct sync_plan *plan, int op, const char *path)
+{
+        const char *slash;
+        struct plan_entry *entries;
+
+        if (plan->used == plan->alloc)
+        {
+                plan->alloc = plan->alloc ? plan->alloc * 2 : 256;
+                entries = realloc (plan->entries, plan->alloc * sizeof (struct plan_entry));
+                if (entries == NULL)
+                        fatal ("Can't allocate the sync plan", errno);
+                plan->entries = entries;
+        }
+
+        entries = &plan->entries[plan->used++];
+        memset (entries, 0, sizeof (struct plan_entry));
+        entries->op = op;
+        entries->path = strdup (path);
+        if (entries->path == NULL)
+                fatal ("Can't allocate the sync plan", errno);
+        slash = strrchr (path, '/');
+        entries->dir_len = slash ? (size_t) (slash - path) : 0;
+
+        return entries;
+}
+
+/**
+ * \brief Remembers that the directory <code>rel</code> was walked.
+ */
+void
+plan_dir_add (struct sync_plan *plan, const char *rel)
+{
+        char **dirs;
+
+        if (plan->dirs_used == plan->dirs_alloc)
+        {
+                plan->dirs_alloc = plan->dirs_alloc ? plan->dirs_alloc * 2 : 64;
+                dirs = realloc (plan->dirs, plan->dirs_alloc * sizeof (char *));
+                if (dirs == NULL)
+                        fatal ("Can't allocate the sync plan", errno);
+                plan->dirs = dirs;
+        }
+        plan->dirs[plan->dirs_used] = strdup (rel);
+        if (plan->dirs[plan->dirs_used] == NULL)
+                fatal ("Can't allocate the sync plan", errno);
+        plan->dirs_used++;
+}
+
+/**
+ * \brief Finds where <code>file</code> is on the disk, to order the copies.
+ * A large file is asked with FIEMAP for its first extent, anything else,
+ * or a filesystem without FIEMAP, gives the inode number.
+ *
+ * \param entry Gets <code>key</code> and <code>far</code>.
+ * \param dir_fd Directory of <code>file</code>, on the side to be read.
+ * \param meta Metadata of <code>file</code>.
+ */
+void
+plan_key (struct plan_entry *entry, int dir_fd, const char *file, const struct stat *meta)
+{
+        int fd;
+        struct
+        {
+                struct fiemap map;
+                struct fiemap_extent extent;
+        } fm;
+
+        entry->key = meta->st_ino;
+        entry->far = 0;
+        if (meta->st_size < PLAN_EXTENT_MIN)
+                return;
+
+        fd = openat (dir_fd, file, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+                return;
+
+        memset (&fm, 0, sizeof (fm));
+        fm.map.fm_length = FIEMAP_MAX_OFFSET;
+        fm.map.fm_extent_count = 1;
+        if (!ioctl (fd, FS_IOC_FIEMAP, &fm.map) && fm.map.fm_mapped_extents > 0)
+        {
+                entry->key = fm.extent.fe_physical;
+                entry->far = 1;
+        }
+        close (fd);
+}
+
+/**
+ * \brief Plans the sync of the file <code>file</code>, as <code>sync_file()</code>.
+ * A file in sync whose copy has another mode or owner gets a
+ * <code>PLAN_ATTR</code>.
+ *
+ * \param meta_to Metadata of the file in <code>to_fd</code>, NULL if it
+ * doesn't exist there or is not known yet.
+ */
+void
+plan_file (struct sync_plan *plan, int from_fd, int to_fd, const char *file, const char *path,
+           const struct stat *meta_to, int known)
+{
+        char msg[MAX_INPUT + PATH_MAX];
+        int newer;
+        uint64_t digest = 0;
+        struct plan_entry *entry;
+        struct stat meta_from, meta_dst;
+        const struct manifest_record *record;
+
+        if (fstatat (from_fd, file, &meta_from, AT_SYMLINK_NOFOLLOW))
+                return;
+
+        record = manifest_find (path, MANIFEST_FILE);
+        if (record && !manifest_match (record, &meta_from))
+                record = NULL;
+        if (record)
+                digest = record->digest;
+
+        if (known)
+        {
+                meta_to = fstatat (to_fd, file, &meta_dst, 0) ? NULL : &meta_dst;
+                if (record && copy_known (path, meta_to) && (verify_mode != VERIFY_STORED || digest == 0))
+                {
+                        manifest_add (path, MANIFEST_FILE, &meta_from, digest);
+                        copy_done (to_fd, file, path, meta_to);
+                        dedup_add (path, &meta_from);
+                        return;
+                }
+        }
+
+        newer = meta_to ? cmp_stat (&meta_from, meta_to) : 1;
+        if (newer == 0 && digest && verify_mode == VERIFY_STORED && verify_stored (to_fd, file, digest))
+        {
+                snprintf (msg, sizeof (msg), "The copy of %s changed on the disk, copying it again", path);
+                report (msg, EIO);
+                __atomic_add_fetch (&metrics.verify_failures, 1, __ATOMIC_RELAXED);
+                newer = 1;
+        }
+
+        if (newer > 0)
+        {
+                entry = plan_add (plan, PLAN_COPY, path);
+                entry->size = meta_from.st_size;
+                plan_key (entry, from_fd, file, &meta_from);
+                plan->bytes[0] += meta_from.st_size;
+        }
+        else if (newer < 0)
+        {
+                entry = plan_add (plan, PLAN_COPY, path);
+                entry->reverse = 1;
+                entry->size = meta_to->st_size;
+                plan_key (entry, to_fd, file, meta_to);
+                plan->bytes[1] += meta_to->st_size;
+        }
+        else
+        {
+                if ((meta_from.st_mode & 07777) != (meta_to->st_mode & 07777) ||
+                    meta_from.st_uid != meta_to->st_uid || meta_from.st_gid != meta_to->st_gid)
+                {
+                        entry = plan_add (plan, PLAN_ATTR, path);
+                        entry->mode = meta_from.st_mode & 07777;
+                        entry->uid = meta_from.st_uid;
+                        entry->gid = meta_from.st_gid;
+                }
+                manifest_add (path, MANIFEST_FILE, &meta_from, digest);
+                copy_done (to_fd, file, path, meta_to);
+                dedup_add (path, &meta_from);
+        }
+}
+
+/**
+ * \brief Plans the sync of the directory <code>rel</code>, recursively.
+ * Like <code>read_dir()</code>, but nothing is written: a directory
+ * missing on the destination gets a <code>PLAN_MKDIR</code> and all its
+ * files are planned as copies.
+ *
+ * \param from_fd Origin location, generally the device directory.
+ * \param to_fd Destination folder, -1 if it doesn't exist yet.
+ * \param rel Path of both, relative to the tops of the pair.
+ */
+void
+plan_dir (struct sync_plan *plan, int from_fd, int to_fd, const char *rel)
+{
+        char path[PATH_MAX];
+        const char *name;
+        int known = 0, sub_from, sub_to;
+        size_t i;
+        struct dir_entry *found;
+        struct dir_index *index = NULL;
+        struct dir_scan scan;
+        struct plan_entry *mkdir_entry;
+        struct stat sb;
+
+        if (dir_scan_read (from_fd, &scan, 1))
+        {
+                report ("Can't read a directory", errno);
+                dir_scan_free (&scan);
+                return;
+        }
+        if (to_fd >= 0)
+        {
+                plan_dir_add (plan, rel);
+                known = dir_known (to_fd, rel);
+                if (!known)
+                        index = dir_index_load (to_fd);
+        }
+
+        for (i = 0; i < scan.used && !sync_cancelled (); i++)
+        {
+                name = scan_name (&scan, i);
+                if (join_path (path, rel, name))
+                        continue;
+
+                if (scan.entries[i].type == DT_DIR)
+                {
+                        sub_from = openat (from_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        if (sub_from < 0)
+                                continue;
+                        sub_to = to_fd < 0 ? -1 : openat (to_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                        if (sub_to < 0 && !fstat (sub_from, &sb))
+                        {
+                                mkdir_entry = plan_add (plan, PLAN_MKDIR, path);
+                                mkdir_entry->mode = sb.st_mode & 07777;
+                                mkdir_entry->uid = sb.st_uid;
+                                mkdir_entry->gid = sb.st_gid;
+                        }
+                        plan_dir (plan, sub_from, sub_to, path);
+                        if (sub_to >= 0)
+                                close (sub_to);
+                        close (sub_from);
+                }
+                else if (scan.entries[i].type == DT_REG)
+                {
+                        found = index ? find_file (index, name) : NULL;
+                        plan_file (plan, from_fd, to_fd, name, path, found ? &found->meta : NULL, known);
+                }
+        }
+        dir_scan_free (&scan);
+        dir_index_free (index);
+}
+
+/**
+ * \brief Orders a plan for sequential reads.
+ * Directories come first, parents before children. Then the work is
+ * grouped by directory and direction, so each directory is opened once,
+ * and inside a group the small files go by inode and the large ones by
+ * where they start on the disk.
+ */
+int
+cmp_plan (const void *a, const void *b)
+{
+        const struct plan_entry *p = a, *q = b;
+        size_t len;
+        int c;
+
+        if ((p->op == PLAN_MKDIR) != (q->op == PLAN_MKDIR))
+                return p->op == PLAN_MKDIR ? -1 : 1;
+        if (p->op == PLAN_MKDIR)
+                return strcmp (p->path, q->path);
+
+        len = p->dir_len < q->dir_len ? p->dir_len : q->dir_len;
+        c = strncmp (p->path, q->path, len);
+        if (c == 0 && p->dir_len != q->dir_len)
+                c = p->dir_len < q->dir_len ? -1 : 1;
+        if (c == 0)
+                c = p->reverse - q->reverse;
+        if (c == 0)
+                c = p->far - q->far;
+        if (c == 0 && p->key != q->key)
+                c = p->key < q->key ? -1 : 1;
+
+        return c;
+}
+
+/**
+ * \brief Prints <code>plan</code> and the bytes it would move.
+ */
+void
+plan_print (const struct sync_plan *plan)
+{
+        size_t i, dirs = 0, copies = 0, attrs = 0;
+        const struct plan_entry *entry;
+
+        for (i = 0; i < plan->used; i++)
+        {
+                entry = &plan->entries[i];
+                switch (entry->op)
+                {
+                        case PLAN_MKDIR:
+                                printf ("mkdir  %s\n", entry->path);
+                                dirs++;
+                                break;
+
+                        case PLAN_COPY:
+                                printf ("copy %s %s (%lld bytes)\n", entry->reverse ? "<-" : "->",
+                                        entry->path, (long long) entry->size);
+                                copies++;
+                                break;
+
+                        case PLAN_ATTR:
+                                printf ("attr   %s (mode %04o, owner %d:%d)\n", entry->path,
+                                        (unsigned) entry->mode, (int) entry->uid, (int) entry->gid);
+                                attrs++;
+                                break;
+                }
+        }
+        printf ("%zu directories, %zu copies, %zu attribute fixes, %lld bytes to %s, %lld bytes to %s\n",
+                dirs, copies, attrs, (long long) plan->bytes[0], src_path ? src_path : "destination",
+                (long long) plan->bytes[1], dev_path ? dev_path : "origin");
+}
+
+/**
+ * \brief Runs <code>plan</code>, in its order.
+ * The directories of the entries are opened with
+ * <code>open_mirror()</code>, which creates what is missing, and kept
+ * open while the entries of the same group run.
+ */
+void
+plan_run (struct sync_plan *plan, int from_root, int to_root)
+{
+        char dir[PATH_MAX];
+        const char *name;
+        int from_fd = -1, to_fd = -1, ret;
+        size_t i;
+        uint64_t digest;
+        struct plan_entry *entry, *last = NULL;
+        struct stat sb;
+
+        for (i = 0; i < plan->used && !sync_cancelled (); i++)
+        {
+                entry = &plan->entries[i];
+
+                if (entry->op == PLAN_MKDIR)
+                {
+                        if (!open_mirror (from_root, to_root, entry->path, &from_fd, &to_fd))
+                        {
+                                close (from_fd);
+                                close (to_fd);
+                        }
+                        from_fd = to_fd = -1;
+                        continue;
+                }
+
+                if (last == NULL || last->dir_len != entry->dir_len || strncmp (last->path, entry->path, entry->dir_len))
+                {
+                        if (from_fd >= 0)
+                        {
+                                close (from_fd);
+                                close (to_fd);
+                        }
+                        snprintf (dir, PATH_MAX, "%.*s", (int) entry->dir_len, entry->path);
+                        if (open_mirror (from_root, to_root, dir, &from_fd, &to_fd))
+                                from_fd = to_fd = -1;
+                        last = entry;
+                }
+                if (from_fd < 0)
+                        continue;
+
+                name = entry->path + entry->dir_len + (entry->dir_len ? 1 : 0);
+                if (entry->op == PLAN_ATTR)
+                {
+                        if (fchownat (to_fd, name, entry->uid, entry->gid, AT_SYMLINK_NOFOLLOW) && errno != EPERM)
+                                report ("Can't change the ownwership of a file", errno);
+                        fchmodat (to_fd, name, entry->mode, 0);
+                        continue;
+                }
+
+                ret = entry->reverse ? copy_from (to_fd, from_fd, name, -1, &digest)
+                                     : dedup_copy (from_fd, to_fd, name, entry->path, &digest);
+                if (ret == 0 && !fstatat (from_fd, name, &sb, 0))
+                {
+                        manifest_add (entry->path, MANIFEST_FILE, &sb, digest);
+                        copy_done (to_fd, name, entry->path, NULL);
+                        /* dedup_copy() indexed its own copies. */
+                        if (entry->reverse)
+                                dedup_add (entry->path, &sb);
+                }
+        }
+
+        if (from_fd >= 0)
+        {
+                close (from_fd);
+                close (to_fd);
+        }
+
+        /* Everything inside is synced, the directories can be remembered. */
+        for (i = 0; manifest.active && i < plan->dirs_used; i++)
+                if (!fstatat (to_root, *plan->dirs[i] ? plan->dirs[i] : ".", &sb, AT_SYMLINK_NOFOLLOW))
+                        manifest_add (plan->dirs[i], MANIFEST_DIR, &sb, 0);
+}
+
+/**
+ * \brief Synchronizes the trees at <code>from_fd</code> and <code>to_fd</code>
+ * in two phases: plans the whole pass, then runs the plan, sorted by
+ * <code>cmp_plan()</code>, in the calling thread. With
+ * <code>dry_run</code>, the plan is only printed.
+ *
+ * \param from_fd Origin location, generally the device directory.
+ * \param to_fd Destination folder, generally the source directory.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+sync_plan (int from_fd, int to_fd)
+{
+        size_t i;
+        long long start = now_us ();
+        struct sync_plan plan;
+
+        memset (&plan, 0, sizeof (struct sync_plan));
+        plan_dir (&plan, from_fd, to_fd, "");
+        qsort (plan.entries, plan.used, sizeof (struct plan_entry), cmp_plan);
+
+        if (dry_run)
+                plan_print (&plan);
+        else
+                plan_run (&plan, from_fd, to_fd);
+        hist_record (&metrics.scan_time, now_us () - start);
+
+        for (i = 0; i < plan.used; i++)
+                free (plan.entries[i].path);
+        for (i = 0; i < plan.dirs_used; i++)
+                free (plan.dirs[i]);
+        free (plan.entries);
+        free (plan.dirs);
+
+        return 0;
+}
+
+/**
+ * \brief Synchronizes the trees at <code>from_path</code> and <code>to_path</code>.
+ * Opens both roots and starts a full pass, which skips what the manifest
+ * of the last one says didn't change, and writes a new manifest. With
+ * <code>use_plan</code> or <code>dry_run</code>, the pass is planned
+ * first by <code>sync_plan()</code>; a dry run keeps the old manifest.
+ *
+ * \param from_path Origin location, generally the device directory.
+ * \param to_path Destination folder, generally the source directory.
+ * \return 0 on success, -1 otherwise.
+ */
+int
+sync_dir (const char *from_path, const char *to_path)
+{
+        int from_fd, to_fd, ret = -1;
+
+        from_fd = open_dir (AT_FDCWD, from_path, DIR_MODE, getuid (), getgid ());
+        to_fd = open_dir (AT_FDCWD, to_path, DIR_MODE, getuid (), getgid ());
+
+        if (from_fd >= 0 && to_fd >= 0)
+        {
+                window_set (from_fd, to_fd);
+                manifest_open ();
+                dedup_open (to_fd);
+                journal_open ();
+                if (use_plan || dry_run)
+                        ret = sync_plan (from_fd, to_fd);
+                else
+                        ret = sync_tree (from_fd, to_fd, "");
+                durable_flush ();
+                dedup_close ();
+                /* A pass cut short doesn't know about everything. */
+                if (sync_stop)
+                        ret = -1;
+                journal_close (ret == 0 && !dry_run);
+                manifest_close (ret == 0 && !dry_run);
+        }
+
+        if (from_fd >= 0)
+                close (from_fd);
+        if (to_fd >= 0)
+                close (to_fd);
+
+        return ret;
+}
+
+/**
+ * \brief Syncs every pair, one after the other, with <code>sync_dir()</code>.
+ * A pair whose device is known by UUID or label, and not mounted, is
+ * skipped.
+ * \return 0 if all of them were synced, -1 otherwise.
+ */
+int
+sync_pairs ()
+{
+        char msg[MAX_INPUT];
+        int i, ret = 0;
+
+        for (i = 0; i < pair_count; i++)
+        {
+                if (device_mount (&pairs[i]))
+                {
+                        snprintf (msg, MAX_INPUT, "The device of %s is not mounted",
+                                  pairs[i].name ? pairs[i].name : "the pair at the top");
+                        report (msg, 0);
+                        continue;
+                }
+                pair_use (&pairs[i]);
+                if (sync_dir (pairs[i].dev_path, pairs[i].src_path))
+                        ret = -1;
+        }
+
+        return ret;
+}
+
+/**
+ * \struct dirty_entry
+ * \brief A path changed since the last sync, with the events it got.
+ * <code>since</code> is when its first event came, in microseconds.
+ * <code>deferred</code> marks a large file left for the end of the sync.
+ */
+struct dirty_entry
+{
+        char *path;
+        uint32_t mask;
+        long long since;
+        int deferred;
+};
+
+/**
+ * \struct dirty_set
+ * \brief The paths waiting for the next sync.
+ * Open addressing hash table, like <code>dir_index</code>, so each path
+ * is kept once, no matter how many events it gets. <code>overflow</code>
+ * tells that events were lost and a full pass is needed.
+ */
+struct dirty_set
+{
+        size_t size;
+        size_t used;
+        struct dirty_entry *slots;
+        int overflow;
+};
+
+/**
+ * \brief Finds the slot of <code>path</code>.
+ * \return The slot holding <code>path</code>, or the empty one where it
+ * should be put.
+ */
+struct dirty_entry *
+dirty_slot (struct dirty_entry *slots, size_t size, const char *path)
+{
+        size_t i = dir_index_hash (path) & (size - 1);
+
+        while (slots[i].path && strcmp (slots[i].path, path))
+                i = (i + 1) & (size - 1);
+
+        return &slots[i];
+}
+
+/**
+ * \brief Marks <code>path</code> as changed by the events in <code>mask</code>.
+ * A path already in the set only gets the new events.
+ */
+void
+dirty_add (struct dirty_set *dirty, const char *path, uint32_t mask)
+{
+        size_t i, size;
+        struct dirty_entry *slot, *slots;
+
+        if (dirty->used * 2 >= dirty->size)
+        {
+                size = dirty->size ? dirty->size * 2 : 64;
+                slots = calloc (size, sizeof (struct dirty_entry));
+                if (slots == NULL)
+                        fatal ("Can't allocate the dirty set", errno);
+                for (i = 0; i < dirty->size; i++)
+                        if (dirty->slots[i].path)
+                                *dirty_slot (slots, size, dirty->slots[i].path) = dirty->slots[i];
+                free (dirty->slots);
+                dirty->slots = slots;
+                dirty->size = size;
+        }
+
+        slot = dirty_slot (dirty->slots, dirty->size, path);
+        if (slot->path == NULL)
+        {
+                slot->path = strdup (path);
+                slot->since = now_us ();
+                dirty->used++;
+                __atomic_add_fetch (&metrics.queued, 1, __ATOMIC_RELAXED);
+        }
+        slot->mask |= mask;
+}
+
+/**
+ * \brief Orders paths so each directory comes right before its contents.
+ * Like <code>strcmp()</code>, but '/' sorts before any other character.
+ */
+int
+cmp_path (const void *a, const void *b)
+{
+        const unsigned char *p = (const unsigned char *) ((const struct dirty_entry *) a)->path;
+        const unsigned char *q = (const unsigned char *) ((const struct dirty_entry *) b)->path;
+        int c, d;
+
+        while (*p && *p == *q)
+        {
+                p++;
+                q++;
+        }
+        c = (*p == '/') ? 1 : *p + 1;
+        d = (*q == '/') ? 1 : *q + 1;
+        if (!*p)
+                c = 0;
+        if (!*q)
+                d = 0;
+
+        return c - d;
+}
+
+/**
+ * \brief Synchronizes one <code>path</code> of the device.
+ * A new directory is copied as a whole, a file is compared and copied
+ * alone. Nothing else of the tree is read.
+ *
+ * \param dev_fd Top of the device tree.
+ * \param src_fd Top of the source tree.
+ * \param path Path relative to both tops.
+ * \param mask The inotify events got by <code>path</code>.
+ */
+void
+sync_path (int dev_fd, int src_fd, const char *path, uint32_t mask)
+{
+        char rel[PATH_MAX];
+        const char *name;
+        int from_fd, to_fd, sub_from, sub_to;
+        struct stat meta_from, meta_to;
+
+        name = strrchr (path, '/');
+        if (name)
+        {
+                snprintf (rel, PATH_MAX, "%.*s", (int) (name - path), path);
+                name++;
+        }
+        else
+        {
+                rel[0] = '\0';
+                name = path;
+        }
+
+        if (open_mirror (dev_fd, src_fd, rel, &from_fd, &to_fd))
+                return;
+
+        if (mask & IN_ISDIR)
+        {
+                if (!open_subdir (from_fd, to_fd, name, &sub_from, &sub_to))
+                {
+                        sync_tree (sub_from, sub_to, path);
+                        close (sub_from);
+                        close (sub_to);
+                }
+        }
+        else if (!fstatat (from_fd, name, &meta_from, AT_SYMLINK_NOFOLLOW) && S_ISREG (meta_from.st_mode))
+        {
+                if (fstatat (to_fd, name, &meta_to, 0))
+                        sync_file (from_fd, to_fd, name, path, NULL, 0);
+                else
+                        sync_file (from_fd, to_fd, name, path, &meta_to, 0);
+        }
+
+        close (from_fd);
+        close (to_fd);
+}
+
+/**
+ * \brief Synchronizes everything in <code>dirty</code>, then empties it.
+ * The paths are sorted, so a new directory is synced before anything
+ * inside it, and the paths inside a directory synced as a whole are
+ * skipped. Files of <code>large_file</code> KiB or more are left for
+ * the end. The wait of each path, from its first event until it is
+ * synced, goes to <code>metrics.event_latency</code>.
+ *
+ * \param dirty The paths changed since the last sync.
+ * \param dev_fd Top of the device tree.
+ * \param src_fd Top of the source tree.
+ */
+void
+sync_dirty (struct dirty_set *dirty, int dev_fd, int src_fd)
+{
+        const char *subtree = NULL;
+        size_t i, n = 0, len = 0;
+        struct dirty_entry *list;
+        struct stat sb;
+
+        list = calloc (dirty->used + 1, sizeof (struct dirty_entry));
+        if (list == NULL)
+                fatal ("Can't allocate the dirty set", errno);
+        for (i = 0; i < dirty->size; i++)
+                if (dirty->slots[i].path)
+                        list[n++] = dirty->slots[i];
+        qsort (list, n, sizeof (struct dirty_entry), cmp_path);
+        window_set (dev_fd, src_fd);
+        dedup_open (src_fd);
+        journal_open ();
+
+        /* Events were lost, only a full pass can catch up. */
+        if (dirty->overflow)
+                sync_tree (dev_fd, src_fd, "");
+        else
+                for (i = 0; i < n && !sync_cancelled (); i++)
+                {
+                        if (subtree && !strncmp (list[i].path, subtree, len) && list[i].path[len] == '/')
+                        {
+                                hist_record (&metrics.event_latency, now_us () - list[i].since);
+                                continue;
+                        }
+
+                        /* Many small edits shouldn't wait behind a big file. */
+                        if (large_file > 0 && !(list[i].mask & IN_ISDIR) &&
+                            !fstatat (dev_fd, list[i].path, &sb, AT_SYMLINK_NOFOLLOW) && sb.st_size >= large_file * Kb)
+                        {
+                                list[i].deferred = 1;
+                                continue;
+                        }
+
+                        sync_path (dev_fd, src_fd, list[i].path, list[i].mask);
+                        hist_record (&metrics.event_latency, now_us () - list[i].since);
+                        if (list[i].mask & IN_ISDIR)
+                        {
+                                subtree = list[i].path;
+                                len = strlen (subtree);
+                        }
+                }
+
+        for (i = 0; i < n; i++)
+        {
+                if (list[i].deferred && !sync_cancelled ())
+                {
+                        sync_path (dev_fd, src_fd, list[i].path, list[i].mask);
+                        hist_record (&metrics.event_latency, now_us () - list[i].since);
+                }
+                else if (dirty->overflow)
+                        hist_record (&metrics.event_latency, now_us () - list[i].since);
+                free (list[i].path);
+        }
+        durable_flush ();
+        dedup_close ();
+        journal_close (0);
+        __atomic_sub_fetch (&metrics.queued, n, __ATOMIC_RELAXED);
+        free (list);
+        memset (dirty->slots, 0, dirty->size * sizeof (struct dirty_entry));
+        dirty->used = 0;
+        dirty->overflow = 0;
+}
+
+/**
+ * \def MOVE_SLOTS
+ * Renames waiting for their second half at once.
+ */
+#define MOVE_SLOTS 64
+
+/**
+ * \def MOVE_WAIT
+ * Milliseconds an IN_MOVED_FROM waits for its IN_MOVED_TO. After that,
+ * the path is taken as moved out of the device.
+ */
+#define MOVE_WAIT 50
+
+/**
+ * \struct pending_move
+ * \brief The first half of a rename, its IN_MOVED_FROM.
+ */
+struct pending_move
+{
+        uint32_t cookie;
+        int is_dir;
+        long long when;
+        char *path;
+};
+
+/**
+ * \struct known_file
+ * \brief A file of the device as the last full pass saw it.
+ */
+struct known_file
+{
+        uint64_t ino;
+        int64_t size;
+        char *path;
+};
+
+/**
+ * \struct move_set
+ * \brief What the daemon needs to mirror renames.
+ * <code>known</code> is an open addressing table, by inode, of the files
+ * in the manifest. It finds where a file came from when its rename can't
+ * be paired by cookie.
+ */
+struct move_set
+{
+        int used;
+        struct pending_move moves[MOVE_SLOTS];
+        size_t known_size;
+        struct known_file *known;
+};
+
+/**
+ * \struct pair_state
+ * \brief What the daemon keeps for each pair: the open tops of its
+ * trees, the changed paths, the renames in progress, and when the first
+ * and the last pending events came, in milliseconds. <code>rescan</code>
+ * asks for a full pass, as when the device was just mounted.
+ * The top of a device known by UUID or label is only open during a turn
+ * of the daemon, or it couldn't be unmounted.
+ */
+struct pair_state
+{
+        struct sync_pair *pair;
+        int dev_fd, src_fd;
+        struct dirty_set dirty;
+        struct move_set moves;
+        long long first, last;
+        int rescan;
+};
+
+/**
+ * \brief Tells if the device of <code>state</code> comes and goes.
+ */
+int
+device_hotplug (const struct pair_state *state)
+{
+        return state->pair->device_uuid || state->pair->device_label;
+}
+
+/**
+ * \brief Opens the top of the device tree of <code>state</code>, if it
+ * isn't yet.
+ * \return 0 if it is open, -1 otherwise.
+ */
+int
+device_open (struct pair_state *state)
+{
+        if (state->dev_fd < 0 && state->pair->dev_path)
+                state->dev_fd = open (state->pair->dev_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        return state->dev_fd < 0 ? -1 : 0;
+}
+
+/**
+ * \def WATCH_EVENTS
+ * The events watched on each directory of the device.
+ */
+#define WATCH_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW)
+
+/**
+ * \struct watch_tree
+ * \brief The inotify watches over the device trees of all the pairs.
+ * <code>paths</code> and <code>owners</code> are indexed by watch
+ * descriptor, which the kernel hands out in increasing order. They hold
+ * the path of the watched directory, relative to the device directory of
+ * its pair, "" for the top, and the pair.
+ */
+struct watch_tree
+{
+        int fd;
+        int size;
+        char **paths;
+        struct pair_state **owners;
+};
+
+/**
+ * \brief Watches the directory <code>rel</code> of the device of a pair.
+ * If the directory was already watched, by other name, only the name
+ * changes.
+ *
+ * \param tree The watches.
+ * \param state The pair.
+ * \param rel Path relative to the device directory of the pair.
+ * \return The watch descriptor, -1 on error.
+ */
+int
+watch_add (struct watch_tree *tree, struct pair_state *state, const char *rel)
+{
+        char path[PATH_MAX], msg[MAX_INPUT + PATH_MAX], **paths;
+        int wd, size;
+        struct pair_state **owners;
+
+        if (join_path (path, state->pair->dev_path, rel))
+                return -1;
+
+        wd = inotify_add_watch (tree->fd, path, WATCH_EVENTS);
+        if (wd < 0)
+        {
+                snprintf (msg, sizeof (msg), "Can't add a watch event to %s", path);
+                report (msg, errno);
+                return -1;
+        }
+
+        if (wd >= tree->size)
+        {
+                for (size = tree->size ? tree->size : 64; size <= wd; size *= 2)
+                        ;
+                paths = realloc (tree->paths, size * sizeof (char *));
+                if (paths == NULL)
+                        fatal ("Can't allocate the watch tree", errno);
+                memset (paths + tree->size, 0, (size - tree->size) * sizeof (char *));
+                tree->paths = paths;
+                owners = realloc (tree->owners, size * sizeof (struct pair_state *));
+                if (owners == NULL)
+                        fatal ("Can't allocate the watch tree", errno);
+                memset (owners + tree->size, 0, (size - tree->size) * sizeof (struct pair_state *));
+                tree->owners = owners;
+                tree->size = size;
+        }
+
+        free (tree->paths[wd]);
+        tree->paths[wd] = strdup (rel);
+        tree->owners[wd] = state;
+
+        return wd;
+}
+
+/**
+ * \brief Watches <code>rel</code> and all its subdirectories.
+ *
+ * \param tree The watches.
+ * \param state The pair.
+ * \param dir_fd Open directory <code>rel</code>.
+ * \param rel Path relative to the device directory of the pair.
+ * \return The watch descriptor of <code>rel</code>, -1 on error.
+ */
+int
+watch_add_tree (struct watch_tree *tree, struct pair_state *state, int dir_fd, const char *rel)
+{
+        char path[PATH_MAX];
+        int wd, sub_fd;
+        size_t i;
+        struct dir_scan scan;
+
+        wd = watch_add (tree, state, rel);
+        if (wd < 0)
+                return -1;
+
+        if (dir_scan_read (dir_fd, &scan, 1))
+        {
+                dir_scan_free (&scan);
+                return wd;
+        }
+
+        for (i = 0; i < scan.used; i++)
+        {
+                if (scan.entries[i].type != DT_DIR || join_path (path, rel, scan_name (&scan, i)))
+                        continue;
+
+                sub_fd = openat (dir_fd, scan_name (&scan, i), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (sub_fd < 0)
+                        continue;
+                watch_add_tree (tree, state, sub_fd, path);
+                close (sub_fd);
+        }
+        dir_scan_free (&scan);
+
+        return wd;
+}
+
+/**
+ * \brief Finds the slot of inode <code>ino</code> in <code>moves->known</code>.
+ * \return The slot, or the empty one where it should be, NULL without table.
+ */
+struct known_file *
+known_slot (const struct move_set *moves, uint64_t ino)
+{
+        size_t i;
+
+        if (moves->known == NULL)
+                return NULL;
+
+        i = (ino * 11400714819323198485ULL) & (moves->known_size - 1);
+        while (moves->known[i].path && moves->known[i].ino != ino)
+                i = (i + 1) & (moves->known_size - 1);
+
+        return &moves->known[i];
+}
+
+/**
+ * \brief Fills <code>moves->known</code> with the files in the manifest.
+ * Called once, after the first full pass wrote it.
+ */
+void
+known_load (struct move_set *moves)
+{
+        uint64_t i;
+        struct known_file *slot;
+        const struct manifest_record *record;
+
+        manifest_open ();
+        if (manifest.slots)
+        {
+                for (moves->known_size = 64; moves->known_size < manifest.size * 2; moves->known_size *= 2)
+                        ;
+                moves->known = calloc (moves->known_size, sizeof (struct known_file));
+                if (moves->known == NULL)
+                        fatal ("Can't allocate the known files", errno);
+
+                for (i = 0; i < manifest.size; i++)
+                {
+                        record = &manifest.slots[i];
+                        if (record->hash == 0 || record->type != MANIFEST_FILE ||
+                            record->path + record->len > manifest.names_len)
+                                continue;
+                        slot = known_slot (moves, record->ino);
+                        free (slot->path);
+                        slot->ino = record->ino;
+                        slot->size = record->size;
+                        slot->path = strndup (manifest.names + record->path, record->len);
+                }
+        }
+        manifest_close (0);
+}
+
+/**
+ * \brief Tells if <code>path</code> is <code>dir</code> or is inside it.
+ * \return The length of <code>dir</code> if so, 0 otherwise.
+ */
+size_t
+path_under (const char *path, const char *dir)
+{
+        size_t len = strlen (dir);
+
+        if (strncmp (path, dir, len) || (path[len] != '\0' && path[len] != '/'))
+                return 0;
+
+        return len;
+}
+
+/**
+ * \brief Writes <code>path</code>, moved from <code>old</code> to
+ * <code>new</code>, in a new string.
+ * \return The new path, NULL if it doesn't fit in <code>PATH_MAX</code>.
+ */
+char *
+path_moved (const char *path, const char *old, const char *new)
+{
+        char buf[PATH_MAX];
+        size_t len = path_under (path, old);
+
+        if (snprintf (buf, PATH_MAX, "%s%s", new, path + len) >= PATH_MAX)
+                return NULL;
+
+        return strdup (buf);
+}
+
+/**
+ * \brief Gives the watches of a pair under <code>old</code> their names
+ * under <code>new</code>. The kernel keeps the watches of a moved
+ * directory.
+ */
+void
+watch_rename (struct watch_tree *tree, struct pair_state *state, const char *old, const char *new)
+{
+        char *path;
+        int wd;
+
+        for (wd = 0; wd < tree->size; wd++)
+                if (tree->paths[wd] && tree->owners[wd] == state && path_under (tree->paths[wd], old) && (path = path_moved (tree->paths[wd], old, new)))
+                {
+                        free (tree->paths[wd]);
+                        tree->paths[wd] = path;
+                }
+}
+
+/**
+ * \brief Removes the watches of a pair under <code>old</code>, moved out
+ * of the device. Their paths are released with the IN_IGNORED that
+ * follows.
+ */
+void
+watch_forget (struct watch_tree *tree, struct pair_state *state, const char *old)
+{
+        int wd;
+
+        for (wd = 0; wd < tree->size; wd++)
+                if (tree->paths[wd] && tree->owners[wd] == state && path_under (tree->paths[wd], old))
+                        inotify_rm_watch (tree->fd, wd);
+}
+
+/**
+ * \brief Moves the changed paths under <code>old</code> to <code>new</code>.
+ * The table is rebuilt, as open addressing can't just drop entries.
+ */
+void
+dirty_rename (struct dirty_set *dirty, const char *old, const char *new)
+{
+        char *path;
+        size_t i, size = dirty->size;
+        struct dirty_entry *slots = dirty->slots, *slot;
+
+        if (dirty->used == 0)
+                return;
+
+        dirty->slots = calloc (size, sizeof (struct dirty_entry));
+        if (dirty->slots == NULL)
+                fatal ("Can't allocate the dirty set", errno);
+
+        for (i = 0; i < size; i++)
+        {
+                if (slots[i].path == NULL)
+                        continue;
+                if (path_under (slots[i].path, old) && (path = path_moved (slots[i].path, old, new)))
+                {
+                        free (slots[i].path);
+                        slots[i].path = path;
+                }
+                slot = dirty_slot (dirty->slots, size, slots[i].path);
+                if (slot->path)
+                {
+                        /* Already there under the new name. */
+                        slot->mask |= slots[i].mask;
+                        free (slots[i].path);
+                        dirty->used--;
+                        __atomic_sub_fetch (&metrics.queued, 1, __ATOMIC_RELAXED);
+                }
+                else
+                        *slot = slots[i];
+        }
+        free (slots);
+}
+
+/**
+ * \brief Mirrors the rename of <code>old</code> to <code>new</code>, on
+ * the source, with one <code>renameat()</code>.
+ * The watches, the changed paths and the known files follow the new name.
+ * A renamed file is still marked as changed, to be compared, which costs
+ * no copy if it is the same.
+ *
+ * \return 0 if the source was renamed, -1 if the new path must be synced
+ * as any other.
+ */
+int
+move_apply (struct watch_tree *tree, struct pair_state *state, const char *old, const char *new, int is_dir)
+{
+        char parent[PATH_MAX], msg[MAX_INPUT + 2 * PATH_MAX], *path;
+        const char *slash;
+        int from_fd, to_fd, src_fd = state->src_fd;
+        size_t i;
+        struct move_set *moves = &state->moves;
+
+        if (is_dir)
+                watch_rename (tree, state, old, new);
+
+        /* The new parent may still be missing on the source. */
+        slash = strrchr (new, '/');
+        snprintf (parent, PATH_MAX, "%.*s", slash ? (int) (slash - new) : 0, new);
+        if (open_mirror (state->dev_fd, src_fd, parent, &from_fd, &to_fd))
+                return -1;
+        close (from_fd);
+        close (to_fd);
+
+        if (renameat (src_fd, old, src_fd, new))
+                return -1;
+
+        snprintf (msg, sizeof (msg), "%s renamed to %s", old, new);
+        report (msg, 0);
+
+        dirty_rename (&state->dirty, old, new);
+        for (i = 0; moves->known && i < moves->known_size; i++)
+                if (moves->known[i].path && path_under (moves->known[i].path, old) &&
+                    (path = path_moved (moves->known[i].path, old, new)))
+                {
+                        free (moves->known[i].path);
+                        moves->known[i].path = path;
+                }
+        if (!is_dir)
+                dirty_add (&state->dirty, new, IN_MOVED_TO);
+
+        return 0;
+}
+
+/**
+ * \brief Keeps the first half of a rename until its pair comes.
+ */
+void
+move_from (struct watch_tree *tree, struct pair_state *state, const char *path, uint32_t cookie, int is_dir)
+{
+        struct move_set *moves = &state->moves;
+        struct pending_move *move;
+
+        /* Too many halves, the oldest is taken as moved out. */
+        if (moves->used == MOVE_SLOTS)
+        {
+                if (moves->moves[0].is_dir)
+                        watch_forget (tree, state, moves->moves[0].path);
+                free (moves->moves[0].path);
+                memmove (moves->moves, moves->moves + 1, (MOVE_SLOTS - 1) * sizeof (struct pending_move));
+                moves->used--;
+        }
+
+        move = &moves->moves[moves->used];
+        move->path = strdup (path);
+        if (move->path == NULL)
+                return;
+        move->cookie = cookie;
+        move->is_dir = is_dir;
+        move->when = now_us () / 1000;
+        moves->used++;
+}
+
+/**
+ * \brief Handles the second half of a rename, <code>path</code> being the
+ * new name. It is paired by <code>cookie</code> with its IN_MOVED_FROM,
+ * or else a file is looked up by inode in the known files, as long as its
+ * old name is gone from the device and still on the source.
+ *
+ * \return 0 if the rename was mirrored, -1 if <code>path</code> must be
+ * synced as new.
+ */
+int
+move_to (struct watch_tree *tree, struct pair_state *state, const char *path, uint32_t cookie, int is_dir)
+{
+        char *old = NULL;
+        int i, ret = -1, dev_fd = state->dev_fd, src_fd = state->src_fd;
+        struct move_set *moves = &state->moves;
+        struct known_file *known;
+        struct stat sb;
+
+        for (i = 0; i < moves->used; i++)
+                if (moves->moves[i].cookie == cookie)
+                {
+                        old = moves->moves[i].path;
+                        memmove (moves->moves + i, moves->moves + i + 1, (moves->used - i - 1) * sizeof (struct pending_move));
+                        moves->used--;
+                        break;
+                }
+
+        if (old == NULL && !is_dir && !fstatat (dev_fd, path, &sb, AT_SYMLINK_NOFOLLOW) &&
+            (known = known_slot (moves, sb.st_ino)) && known->path && known->size == sb.st_size &&
+            strcmp (known->path, path) && fstatat (dev_fd, known->path, &sb, AT_SYMLINK_NOFOLLOW) &&
+            !fstatat (src_fd, known->path, &sb, AT_SYMLINK_NOFOLLOW) && sb.st_size == known->size)
+                old = strdup (known->path);
+
+        if (old)
+        {
+                ret = move_apply (tree, state, old, path, is_dir);
+                free (old);
+        }
+
+        return ret;
+}
+
+/**
+ * \brief Drops the halves of renames that waited too long.
+ * Their paths left the device; a directory loses its watches.
  */
-char *                                                        
-cwdir (const char *dir_cur, const char *dir, mode_t mode, uid_t owner, gid_t group)
+void
+move_expire (struct watch_tree *tree, struct pair_state *state, long long now)
 {
-        char *cur, *cwd, *msg;
-
-        msg = calloc (MAX_INPUT, sizeof (char));
-
-        cur = getcwd (NULL, 0);
-        if (chdir (dir_cur))
-        {
-                strcat (msg, "Can't access ");
-                strcat (msg, dir_cur);
-                fatal (msg, errno);
-        }
+        int i, n = 0;
+        struct move_set *moves = &state->moves;
 
-        if (chdir (dir))
+        for (i = 0; i < moves->used; i++)
         {
-                if (errno == EACCES)
-                {
-                        strcat (msg, "Can't access ");
-                        strcat (msg, dir);
-                        fatal (msg, errno);
-                }
-                else if (errno == ENOENT)
+                if (now - moves->moves[i].when < MOVE_WAIT)
                 {
-                        if (mkdir (dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH))
-                        {
-                                strcat (msg, dir);
-                                strcat (msg, " doesn't exist. Can't make it.");
-                                fatal (msg, errno);
-                        }
-                        else
-                        {
-                                chmod (dir, mode);
-                                chown (dir, owner, group);
-
-                                chdir (dir);
-                        }
+                        moves->moves[n++] = moves->moves[i];
+                        continue;
                 }
-                else
-                        /*If errno is unknown, just warn and try to move on.*/
-                        report ("This error can't be handled", errno);
-
+                if (moves->moves[i].is_dir)
+                        watch_forget (tree, state, moves->moves[i].path);
+                free (moves->moves[i].path);
         }
-        cwd = getcwd (NULL, 0);
-        /* This function don't change the current directory. */
-        chdir (cur);
-
-        free (msg);
-
-        /* cwd contains the path of dir. */
-        return cwd;
+        moves->used = n;
 }
 
 /**
- * \brief Open and read the configuration file.
- * Get <code>conf_path</code>, open and read
- * the settings file, collecting user options.
+ * \brief Records the path named by one inotify <code>event</code>, in
+ * the pair that owns its watch.
+ * The watches are kept up to date at once, so nothing created in a new
+ * directory is lost, but the sync waits for <code>sync_dirty()</code>.
+ * Renames are the exception: they are mirrored on the source at once, by
+ * <code>move_to()</code>, when both names are known.
  *
- * \param conf_path Path of configuration file.
- * \return Not implemented yet.
- * \see confuse.h
+ * \param tree The watches.
+ * \param states The pairs, <code>pair_count</code> of them.
+ * \param event The event read from <code>tree->fd</code>.
+ * \return The pair of the event, NULL if it has none.
  */
-int
-read_option (const char *conf_path, uid_t owner, gid_t group)
+struct pair_state *
+watch_event (struct watch_tree *tree, struct pair_state *states, const struct inotify_event *event)
 {
-        char *cwd, *msg;
-        FILE *conf_file;
-        cfg_t *cfg;
-        cfg_opt_t opts[] = {
-                CFG_SIMPLE_STR ("device_path", &dev_path),
-                CFG_SIMPLE_STR ("source_path", &src_path),
-                CFG_END()
-        };
+        char path[PATH_MAX];
+        const char *rel;
+        int i, sub_fd;
+        struct pair_state *state;
 
-        msg = calloc (MAX_INPUT, sizeof (char));
+        /* No telling whose events were lost. */
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+                for (i = 0; i < pair_count; i++)
+                        states[i].dirty.overflow = 1;
+                return NULL;
+        }
 
-        cwd = getcwd (NULL, 0);
-        if (cwdir (cwd, conf_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH, owner, group))
-                chdir (conf_path);
+        if (event->wd < 0 || event->wd >= tree->size || tree->paths[event->wd] == NULL)
+                return NULL;
+        rel = tree->paths[event->wd];
+        state = tree->owners[event->wd];
+        device_open (state);
 
-        conf_file = fopen (".cpusb", "a");
-        if (!conf_file)
+        /* The directory is gone, so is its watch. */
+        if (event->mask & IN_IGNORED)
         {
-                strcat (msg, "Can't open the configuration file in ");
-                strcat (msg, conf_path);
-                fatal (msg, errno);
+                free (tree->paths[event->wd]);
+                tree->paths[event->wd] = NULL;
+                tree->owners[event->wd] = NULL;
+                return NULL;
         }
-        else
-                fclose (conf_file);
 
-        cfg = cfg_init (opts, 0);
-        cfg_parse (cfg, ".cpusb");
-        cfg_free(cfg);
+        /* Events on the watched directory itself carry no name. */
+        if (event->len == 0 || !strncmp (event->name, TMP_PREFIX, sizeof (TMP_PREFIX) - 1) ||
+            join_path (path, rel, event->name))
+                return NULL;
 
-        if (cwdir (cwd, dev_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH, owner, group) == NULL)
+        if (event->mask & IN_MOVED_FROM)
         {
-                strcat (msg, "Can't access the device directory: ");
-                strcat (msg, dev_path);
-                fatal (msg, errno);
+                move_from (tree, state, path, event->cookie, (event->mask & IN_ISDIR) != 0);
+                return state;
         }
-        if (cwdir (cwd, src_path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH, owner, group) == NULL)
+        if ((event->mask & IN_MOVED_TO) &&
+            !move_to (tree, state, path, event->cookie, (event->mask & IN_ISDIR) != 0))
+                return state;
+
+        if (event->mask & IN_ISDIR)
         {
-                strcat (msg, "Can't access the source directory: ");
-                strcat (msg, src_path);
-                fatal (msg, errno);
+                if (event->mask & (IN_CREATE | IN_MOVED_TO))
+                {
+                        sub_fd = openat (state->dev_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        if (sub_fd >= 0)
+                        {
+                                watch_add_tree (tree, state, sub_fd, path);
+                                close (sub_fd);
+                        }
+                        dirty_add (&state->dirty, path, event->mask);
+                }
         }
+        /* A file just created is still being written, wait for IN_CLOSE_WRITE. */
+        else if (event->mask & (IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_TO))
+                dirty_add (&state->dirty, path, event->mask);
+
+        return state;
+}
 
-        free (msg);
+/**
+ * \brief Milliseconds of the monotonic clock.
+ */
+long long
+now_ms ()
+{
+        struct timespec ts;
 
-        /**
-         * \todo Implement the return stament 
-         */
-        return 1;
+        clock_gettime (CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
+/**
+ * \brief SIGUSR1 handler, asks the daemon for a dump of the metrics.
+ */
 void
-install_conf (const char *conf_path, uid_t owner, gid_t group)
+dump_signal (int sig)
 {
-        char *cwd, *msg;
-        FILE *conf_file;
+        (void) sig;
+        dump_asked = 1;
+}
 
-        msg = calloc (MAX_INPUT, sizeof (char));
+/**
+ * \brief Writes the metrics, as text, to <code>LOG_PATH</code>/cpusb.metrics.
+ */
+void
+metrics_save ()
+{
+        FILE *out;
 
-        cwd = getcwd (NULL, 0); 
-        cwdir (cwd, conf_path, O_WRONLY, owner, group);
-        chdir (conf_path);
-        conf_file = fopen (".cpusb", "w+");
-        if (!conf_file)
+        out = fopen (LOG_PATH "/cpusb.metrics", "w");
+        if (out == NULL)
         {
-                strcat (msg, "Can't open the configuration file in ");
-                strcat (msg, conf_path);
-                fatal (msg, errno);
+                report ("Can't write the metrics", errno);
+                return;
         }
-
-        fflush (stdin);
-
-        dev_path = readline ("Device directory: ");
-        fprintf (conf_file, "device_path = %s\n", dev_path);
-        /** \todo error handling. */
-
-        src_path = readline ("Destination directory: ");
-        fprintf (conf_file, "source_path = %s\n", src_path);
-        /** \todo error handling. */
-
-        if (fclose (conf_file))
-                report ("Configuration file was closed with error", errno);
-
-        free (msg);
-
-        chdir (cwd);	
+        metrics_dump (out, 0);
+        fclose (out);
 }
 
 /**
- * \brief Performs the copy between the device and source.
- * Receiving a source and a destination directory, performs the copy in the 
- * direction of the device to the source. First loading the file into a dynamic 
- * buffer size, creating the destination folder, if necessary, create or 
- * truncate the target file, copy and releases the buffer.
+ * \brief Opens the control socket at <code>control_path</code>.
+ * A socket left by an old daemon is replaced. Only the owner can connect.
  *
- * \param dir_dev Initial directory of origin file
- * \param dir_src Directory of copied file
- * \param file File to be copied
- **/
+ * \return The listening socket, -1 if there is none.
+ */
 int
-copy(const char *dir_dev, const char *dir_src, const char *file)
+control_open ()
 {
-        FILE *file_dev;
-        FILE *file_src;
-        char *buf, *cwd, *msg;
-        int fd, rd, wr;
-        __off_t file_size;
-        size_t mult, rest, cnt;
-        struct stat file_meta;
-
-        msg = calloc (MAX_INPUT, sizeof (char));
+        char msg[MAX_INPUT + PATH_MAX];
+        int fd;
+        struct sockaddr_un addr;
 
-        cwd = getcwd (NULL, 0);
-        chdir (dir_dev);
+        if (control_path == NULL || strlen (control_path) >= sizeof (addr.sun_path))
+                return -1;
 
-        fd = open (file, O_RDONLY);
-        file_dev = fdopen (fd, "r");
-        if (fd < 0 || file_dev == NULL)
-        {
-                strcat (msg, "Can't open ");
-                strcat (msg, file);
-                fatal (msg, errno);
-        }
-        fstat (fd, &file_meta);
-        file_size = file_meta.st_size;
-        if (file_size <= 0)
+        fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
         {
-                strcat (msg, file);
-                strcat (msg, " corrupted");
-                report (msg, errno);
+                report ("Can't make the control socket", errno);
                 return -1;
         }
 
-        if (cwdir (cwd, dir_src, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH, file_meta.st_uid, file_meta.st_gid))
-                chdir (dir_src);
-
-        file_src = fopen (file, "w");
-        if (file_src == NULL)
+        memset (&addr, 0, sizeof (struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
+        strcpy (addr.sun_path, control_path);
+        unlink (control_path);
+        if (bind (fd, (struct sockaddr *) &addr, sizeof (struct sockaddr_un)) ||
+            chmod (control_path, S_IRUSR | S_IWUSR) || listen (fd, 8))
         {
-                strcat (msg, "Can't open ");
-                strcat (msg, file);
+                snprintf (msg, sizeof (msg), "Can't listen on %s", control_path);
                 report (msg, errno);
+                close (fd);
                 return -1;
         }
 
-        /* If the file is heavier than a Mega(buffer size),
-         * the buffer will contain pointers for space dinamically allocated.*/
-        if (file_size > Kb)
-        {
-                mult = file_size / Kb;
-                rest = file_size % Kb;
-                for(cnt = 0; cnt < mult;cnt++)
-                {
-                        buf = malloc (Kb);
-                        /* setvbuf (file_src, buf, _IOFBF, Kb); */
-                        fread (buf, Kb, 1, file_dev);
-                        fwrite (buf, Kb, 1, file_src);
-                        free (buf);
-                }
-                buf = malloc (rest);
-                /* setvbuf (file_src, buf_index, _IOFBF, rest); */
-                rd = fread (buf, rest, 1, file_dev);
-                wr = fwrite (buf, rest, 1, file_src);
-                if (rd != wr || rd <= 0 || wr <= 0)
-                {
-                        strcat (msg, "Error copying ");
-                        strcat (msg, file);
-                        report (msg, errno);
-                        return -1;
-                }
-                free (buf);
-        }
-        else
+        return fd;
+}
+
+/**
+ * \brief Answers one client of the control socket.
+ * A client that sends "json" gets the metrics in JSON, any other request,
+ * or none within 100 milliseconds, gets them in text. The connection is
+ * closed after the answer.
+ *
+ * \param listen_fd The control socket.
+ */
+void
+control_answer (int listen_fd)
+{
+        char req[64], *buf = NULL;
+        int fd;
+        size_t len = 0;
+        ssize_t rd = 0;
+        FILE *out;
+        struct pollfd pfd;
+        struct timeval tv = {1, 0};
+
+        fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+                return;
+
+        /* A client that doesn't read can't hold the daemon for long. */
+        setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (struct timeval));
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll (&pfd, 1, 100) > 0)
+                rd = read (fd, req, sizeof (req) - 1);
+        req[rd > 0 ? rd : 0] = '\0';
+
+        out = open_memstream (&buf, &len);
+        if (out)
         {
-                buf = malloc (file_size);
-                rd = fread (buf, file_size, 1, file_dev);
-                wr = fwrite (buf, file_size, 1, file_src);
-                if (rd != wr || rd <= 0 || wr <= 0)
-                {
-                        strcat (msg, "Error copying ");
-                        strcat (msg, file);
-                        report (msg, errno);
-                        return -1;
-                }
+                metrics_dump (out, !strncmp (req, "json", 4));
+                fclose (out);
+                write_all (fd, buf, len);
                 free (buf);
         }
+        close (fd);
+}
 
-        if (chmod (file, file_meta.st_mode))
-        {
-                strcat (msg, "Can't change the permissions of ");
-                strcat (msg, file);
-                report (msg, errno);
-        }
-        if (chown (file, file_meta.st_uid, file_meta.st_gid))
-        {
-                strcat (msg, "Can't change the ownwership of ");
-                strcat (msg, file);
-                report (msg, errno);
-        }
+/**
+ * \brief Tells when the changes of a pair should be synced: once no
+ * event came for <code>quiet_window</code> milliseconds, or the oldest
+ * change waited <code>max_latency</code>.
+ *
+ * \return Milliseconds left, 0 if due now, -1 if nothing is pending.
+ */
+long long
+pair_due (const struct pair_state *state, long long now)
+{
+        long long wait;
 
-        free (msg);
+        if (state->rescan)
+                return 0;
+        if (!state->dirty.used && !state->dirty.overflow)
+                return -1;
 
-        close (fd);
-        fclose (file_dev);
-        fclose (file_src);
-        chdir (cwd);
+        wait = state->pair->quiet_window - (now - state->last);
+        if (wait > state->pair->max_latency - (now - state->first))
+                wait = state->pair->max_latency - (now - state->first);
 
-        return 0;
+        return wait < 0 ? 0 : wait;
 }
 
 /**
- * \brief Reads the <code>from_path</code>, for coping your contents.
- * Open <code>from_path</code>, make a search, taking each file or directory,
- * For each file or directory, try to find on other location, between device and
- * source directory. Look to your content and do copy from the newest to the oldest.
- * 
- * \param from_path Origin location, generally the device directory.
- * \param to_path Destination folder, generally the source directory.
- * \return Not implemented yet.
+ * \brief Starts watching the device of <code>state</code>, just found
+ * mounted at <code>mount</code>, and asks for a full pass at once; the
+ * manifest makes it look only at what changed while it was away.
  */
-int
-read_dir (const char *from_path, char *to_path)
+void
+device_attach (struct watch_tree *tree, struct pair_state *state, const char *mount)
 {
-        DIR *dir = NULL;
-        struct dirent *entry;
-        struct stat sb;
+        char msg[MAX_INPUT + PATH_MAX];
+        const char *name = state->pair->name ? state->pair->name : "the pair at the top";
 
-        dir = opendir (from_path);
-        stat (from_path, &sb);
-
-        while ((entry = readdir (dir)) != NULL)
+        state->pair->dev_path = strdup (mount);
+        if (device_open (state) || watch_add_tree (tree, state, state->dev_fd, "") < 0)
         {
-                if (entry->d_type == DT_DIR)
-                {
-                        if (!strcmp (entry->d_name, ".") || !strcmp (entry->d_name, ".."))
-                                continue;
-                        else
-                        {
-                                chdir (entry->d_name);
-                                read_dir (getcwd (NULL, 0), cwdir (to_path, entry->d_name, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH, sb.st_uid, sb.st_gid));
-                                chdir ("..");
-                        }
-                }
-                else if (entry->d_type == DT_REG)
-                {
-                        if (find_file (to_path, entry->d_name))
-                        {
-                                if (cmp_stat (from_path, to_path, entry->d_name))
-                                        copy (from_path, to_path, entry->d_name);
-                                else
-                                        copy (to_path, from_path, entry->d_name);
-                        }
-                        else
-                                copy (from_path, to_path, entry->d_name);
-                }
+                snprintf (msg, sizeof (msg), "Can't watch the device of %s, at %s", name, mount);
+                report (msg, errno);
+                if (state->dev_fd >= 0)
+                        close (state->dev_fd);
+                state->dev_fd = -1;
+                free (state->pair->dev_path);
+                state->pair->dev_path = NULL;
+                return;
         }
-        closedir (dir);
 
-        /**
-         * \todo Implement the return stament 
-         */
-        return 1;
+        snprintf (msg, sizeof (msg), "The device of %s is mounted at %s", name, mount);
+        report (msg, 0);
+        state->rescan = 1;
 }
 
 /**
- * \brief Search a <code>file</code> in <code><dir_path/code>.
- * Returns true if file is found, otherwise returns false.
- *
- * \param dir_path Directory for search.
- * \param file Name of file which will be search.
+ * \brief Forgets the device of <code>state</code>, which was unmounted:
+ * its watches, and the changes and renames not synced yet. Events of
+ * its watches still queued are dropped too, as nobody owns them.
  */
-int
-find_file (const char *dir_path, const char *file)
+void
+device_detach (struct watch_tree *tree, struct pair_state *state)
 {
-        DIR *dir_cur;
-        int ret = 0; /* Default, file not found. */
-        struct dirent *entry;
+        char msg[MAX_INPUT];
+        int i;
+        size_t j;
 
-        dir_cur = opendir (dir_path);
-        if (dir_cur)
-        {
-                while ((entry = readdir (dir_cur)))
+        for (i = 0; i < tree->size; i++)
+                if (tree->paths[i] && tree->owners[i] == state)
                 {
-                        if (!strcmp (entry->d_name, file))
-                        {
-                                /* I found it! */
-                                ret = 1;
-                                break;
-                        }
+                        inotify_rm_watch (tree->fd, i);
+                        free (tree->paths[i]);
+                        tree->paths[i] = NULL;
+                        tree->owners[i] = NULL;
                 }
-                closedir (dir_cur);
-        }
 
-        return ret;
+        for (j = 0; j < state->dirty.size; j++)
+                free (state->dirty.slots[j].path);
+        if (state->dirty.slots)
+                memset (state->dirty.slots, 0, state->dirty.size * sizeof (struct dirty_entry));
+        __atomic_sub_fetch (&metrics.queued, state->dirty.used, __ATOMIC_RELAXED);
+        state->dirty.used = 0;
+        state->dirty.overflow = 0;
+        for (i = 0; i < state->moves.used; i++)
+                free (state->moves.moves[i].path);
+        state->moves.used = 0;
+
+        if (state->dev_fd >= 0)
+                close (state->dev_fd);
+        state->dev_fd = -1;
+        free (state->pair->dev_path);
+        state->pair->dev_path = NULL;
+        state->rescan = 0;
+        state->first = 0;
+
+        snprintf (msg, MAX_INPUT, "The device of %s went away",
+                  state->pair->name ? state->pair->name : "the pair at the top");
+        report (msg, 0);
 }
 
 /**
- * \brief Compare <code>m_time</code> of two files.
- * The <code>m_time in struct stat</code> defined in <code>bits/stat.h</code> 
- * included in <code>sys/stat.h</code>. The field provides the last modification time. 
- * The function returns true if the file has been modified <code>dir_path_dev</code> 
- * finally, false otherwise.
- *
- * \param dir_path_dev A folder on <i>device</i>
- * \param dir_path_src A folder on <i>source</i>
- * \param file Filename. Notice that only one name is passed, because it must be 
- * the same file in different folders.
- * \return m_time True if file <code>dir_path_dev</code> is the newest, false otherwise.
+ * \brief Reads the mounts again, once <code>mount_fd</code> said they
+ * changed: the devices that came are attached, those that went detached.
  */
-int
-cmp_stat (const char *dir_path_dev, const char *dir_path_src, const char *file)
+void
+mounts_update (struct watch_tree *tree, struct pair_state *states)
 {
-        char *root_dir;
-        int fd_dev, fd_src, m_time;
-        struct stat file_meta_dev, file_meta_src;
+        char mount[PATH_MAX];
+        int i, found;
+        struct pair_state *state;
 
-        root_dir = getcwd (NULL, 0);
-        chdir (dir_path_dev);
-        fd_dev = open (file, O_RDONLY | O_APPEND | O_RSYNC);
-        fstat (fd_dev, &file_meta_dev);
-        chdir (dir_path_src);
-        fd_src = open (file, O_RDONLY | O_APPEND | O_RSYNC);
-        fstat (fd_src, &file_meta_src);
-        chdir (root_dir);
-        if (file_meta_dev.st_mtime > file_meta_src.st_mtime)
-                m_time = 1;
-        else
-                m_time = 0;
+        for (i = 0; i < pair_count; i++)
+        {
+                state = &states[i];
+                if (!device_hotplug (state))
+                        continue;
 
-        return m_time;
+                found = !mount_find (state->pair->device_uuid, state->pair->device_label, mount);
+                if (state->pair->dev_path && (!found || strcmp (mount, state->pair->dev_path)))
+                        device_detach (tree, state);
+                if (found && state->pair->dev_path == NULL)
+                        device_attach (tree, state, mount);
+        }
 }
 
 /**
- * \brief Create an event and stay watching.
- * Initialize, e add a <code>inotify_event</code>.
- * Waiting <code>dev_path</code> for changes, then call 
- * <code>read_dir()</code> for start the copy. Do it recursively.
+ * \brief Watch the devices and synchronize what changes.
+ * Initialize inotify and add a watch to every directory of the device
+ * of each pair, all on one inotify instance. Then, stay waiting in epoll
+ * forever. The changed paths of each pair are collected until
+ * <code>pair_due()</code> says so, and synced together by
+ * <code>sync_dirty()</code>. When several pairs are due, they take turns,
+ * one sync each, so a busy pair can't hold the others back.
+ * The devices known by UUID or label may come and go: the daemon waits
+ * on <code>/proc/self/mountinfo</code>, and a device just mounted gets
+ * its watches and a pass right away, one unmounted is dropped, and the
+ * sync under way, if it is its own, stops.
+ * Meanwhile, the metrics are served on the control socket and written to
+ * the log directory on SIGUSR1.
  */
 void cpusb_daemon ()
 {
-        char buf[Kb]__attribute__((aligned(4)));
-        int fd;
-        ssize_t wd, len = 0, i = 0;
+        char buf[EVENT_BUF] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+        char mount[PATH_MAX];
+        int epoll_fd, control_fd, i, n, next = 0;
+        long long now, wait, timeout, pending;
+        ssize_t len, pos;
+        struct inotify_event *event;
+        struct epoll_event ev, ready[3];
+        struct sigaction sa;
+        struct watch_tree tree = {-1, 0, NULL, NULL};
+        struct pair_state *states, *state;
 
-        fd = inotify_init ();
-        if (fd == -1)
+        tree.fd = inotify_init1 (IN_CLOEXEC);
+        if (tree.fd == -1)
                 fatal ("Can't initialize inotify", errno);
 
-        wd = inotify_add_watch (fd, dev_path, IN_ATTRIB | IN_CLOSE_WRITE);
-        if (wd == -1)
-                fatal ("Can't add a watch event", errno);
+        /* Without read_option(), the globals make the only pair. */
+        if (pair_count == 0)
+                pair_add (NULL);
+
+        states = calloc (pair_count, sizeof (struct pair_state));
+        if (states == NULL)
+                fatal ("Can't allocate the sync pairs", errno);
+        for (i = 0; i < pair_count; i++)
+        {
+                state = &states[i];
+                state->pair = &pairs[i];
+                state->dev_fd = -1;
+                state->src_fd = open_dir (AT_FDCWD, state->pair->src_path, DIR_MODE, getuid (), getgid ());
+                if (state->src_fd < 0)
+                        fatal ("Can't access the source directory", errno);
+
+                pair_use (state->pair);
+                known_load (&state->moves);
+
+                if (device_hotplug (state))
+                {
+                        if (mount_fd < 0)
+                                mount_fd = open ("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+                        /* The first pass was just made, if it was there. */
+                        if (!mount_find (state->pair->device_uuid, state->pair->device_label, mount))
+                        {
+                                free (state->pair->dev_path);
+                                state->pair->dev_path = NULL;
+                                device_attach (&tree, state, mount);
+                                state->rescan = 0;
+                        }
+                        continue;
+                }
+
+                state->dev_fd = open_dir (AT_FDCWD, state->pair->dev_path, DIR_MODE, getuid (), getgid ());
+                if (state->dev_fd < 0)
+                        fatal ("Can't access the device directory", errno);
+                if (watch_add_tree (&tree, state, state->dev_fd, "") == -1)
+                        fatal ("Can't add a watch event", errno);
+        }
+
+        /* No SA_RESTART, so the signal also wakes epoll_wait(). */
+        memset (&sa, 0, sizeof (struct sigaction));
+        sa.sa_handler = dump_signal;
+        sigemptyset (&sa.sa_mask);
+        sigaction (SIGUSR1, &sa, NULL);
 
-        len = read (fd, buf, Kb);
+        epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+        if (epoll_fd < 0)
+                fatal ("Can't create the epoll instance", errno);
+        memset (&ev, 0, sizeof (struct epoll_event));
+        ev.events = EPOLLIN;
+        ev.data.fd = tree.fd;
+        if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, tree.fd, &ev))
+                fatal ("Can't wait for the inotify events", errno);
+        control_fd = control_open ();
+        ev.data.fd = control_fd;
+        if (control_fd >= 0 && epoll_ctl (epoll_fd, EPOLL_CTL_ADD, control_fd, &ev))
+                report ("Can't wait on the control socket", errno);
+        ev.events = EPOLLPRI;
+        ev.data.fd = mount_fd;
+        if (mount_fd >= 0 && epoll_ctl (epoll_fd, EPOLL_CTL_ADD, mount_fd, &ev))
+                report ("Can't wait for the devices", errno);
 
-        while (i < len)
+        for (;;)
         {
-                struct inotify_event *event = (struct inotify_event *) &buf[i];
+                /* Sleep until the first pair is due, or the next event. */
+                timeout = -1;
+                now = now_ms ();
+                for (i = 0; i < pair_count; i++)
+                {
+                        wait = pair_due (&states[i], now);
+                        if (wait >= 0 && (timeout < 0 || wait < timeout))
+                                timeout = wait;
+                        /* A rename half waits only a little for its pair. */
+                        if (states[i].moves.used && (timeout < 0 || timeout > MOVE_WAIT))
+                                timeout = MOVE_WAIT;
+                }
+                if (__atomic_load_n (&mount_changed, __ATOMIC_RELAXED))
+                        timeout = 0;
+
+                n = epoll_wait (epoll_fd, ready, 3, timeout);
+                if (n < 0)
+                {
+                        if (errno != EINTR)
+                                fatal ("Can't wait for the inotify events", errno);
+                        n = 0;
+                }
+
+                if (dump_asked)
+                {
+                        dump_asked = 0;
+                        metrics_save ();
+                }
+
+                for (i = 0; i < n; i++)
+                {
+                        if (ready[i].data.fd == control_fd)
+                        {
+                                control_answer (control_fd);
+                                continue;
+                        }
+                        if (ready[i].data.fd == mount_fd)
+                        {
+                                __atomic_store_n (&mount_changed, 1, __ATOMIC_RELAXED);
+                                continue;
+                        }
+
+                        len = read (tree.fd, buf, EVENT_BUF);
+                        if (len < 0 && errno != EINTR && errno != EAGAIN)
+                                fatal ("Can't read the inotify events", errno);
+
+                        now = now_ms ();
+                        for (pos = 0; pos < len; pos += sizeof (struct inotify_event) + event->len)
+                        {
+                                event = (struct inotify_event *) &buf[pos];
+                                state = watch_event (&tree, states, event);
+                                if (state)
+                                {
+                                        state->last = now;
+                                        if (state->first == 0)
+                                                state->first = now;
+                                }
+                        }
+                }
+
+                if (__atomic_exchange_n (&mount_changed, 0, __ATOMIC_RELAXED))
+                        mounts_update (&tree, states);
+
+                now = now_ms ();
+                for (i = 0; i < pair_count; i++)
+                        move_expire (&tree, &states[i], now);
+
+                /* One pair per turn, starting after the last one served. */
+                for (i = 0; i < pair_count; i++)
+                {
+                        state = &states[(next + i) % pair_count];
+                        if (pair_due (state, now) == 0)
+                        {
+                                pair_use (state->pair);
+                                if (state->rescan)
+                                        sync_dir (state->pair->dev_path, state->pair->src_path);
+                                else
+                                {
+                                        /* Even if it can't be opened, the changes are done with. */
+                                        device_open (state);
+                                        sync_dirty (&state->dirty, state->dev_fd, state->src_fd);
+                                }
+                                state->rescan = 0;
+                                state->first = 0;
+                                next = (next + i + 1) % pair_count;
+                                break;
+                        }
+                }
 
-                if (event->mask & IN_CLOSE_WRITE || event->mask & IN_ATTRIB)
+                pending = 0;
+                for (i = 0; i < pair_count; i++)
                 {
-                        /* Start the copy. */
-                        chdir (dev_path);
-                        read_dir (dev_path, src_path);
-                        
-                        cpusb_daemon ();
+                        if (pair_due (&states[i], now) < 0)
+                                states[i].first = 0;
+                        else if (states[i].first && (pending == 0 || states[i].first < pending))
+                                pending = states[i].first;
                 }
+                __atomic_store_n (&metrics.pending_since, pending * 1000, __ATOMIC_RELAXED);
 
-                i += sizeof (struct inotify_event) + event->len;
+                /* Nothing of a removable device stays open between turns. */
+                for (i = 0; i < pair_count; i++)
+                        if (device_hotplug (&states[i]) && states[i].dev_fd >= 0)
+                        {
+                                close (states[i].dev_fd);
+                                states[i].dev_fd = -1;
+                        }
         }
 }
 
 void
 read_args (int argc, char *argv[])
 {
-        char c;
+        char c, *conf_path = NULL, *install_path = NULL;
         /* String with list of short options. */
-        const char *short_options = "fi:h";
-        int option_index = 0;
+        const char *short_options = "fi:hj:n";
+        int option_index = 0, ran = 0, sync_once = 0, install = 0;
+        long jobs = 0;
         struct passwd *pw;
         /* Options of arguments for cpusb. */
         static struct option long_options[]=
@@ -599,6 +7537,8 @@ read_args (int argc, char *argv[])
                 {"file", optional_argument, NULL, 'f'},
                 {"help", no_argument, NULL, 'h'},
                 {"install", optional_argument, NULL, 'i'},
+                {"jobs", required_argument, NULL, 'j'},
+                {"dry-run", no_argument, NULL, 'n'},
                 {NULL, 0, NULL, 0}
         };
 
@@ -607,63 +7547,89 @@ read_args (int argc, char *argv[])
                  */
                 pw = getpwuid (getuid ());
 
-        /* If no arguments, just run. */
-        if (argc == 1)
+        /* The loop should run until end arguments. */
+        while ((c = (char) getopt_long (argc, argv, short_options, 
+                                        long_options, 
+                                        &option_index)) != -1)
+        {
+                option_index = 0;
+                switch (c)
+                {
+                        case 'f':
+                                /* Runs after the loop, so -j and -n count wherever they are. */
+                                conf_path = optarg;
+                                sync_once = 1;
+                                ran = 1;
+                                break;
+
+                        case 'h':
+                                /** 
+                                 * \todo Implement the help() function.
+                                 */
+                                printf("--help\n");
+                                ran = 1;
+                                break;
+
+                        case 'i':
+                                /** 
+                                 * \todo Improve the install() function.
+                                 */
+                                install_path = optarg;
+                                install = 1;
+                                ran = 1;
+                                break;
+
+                        case 'j':
+                                jobs = strtol (optarg, NULL, 10);
+                                break;
+
+                        case 'n':
+                                dry_run = 1;
+                                break;
+
+                        default:
+                                /**
+                                 * \todo There should be an error handling.
+                                 */
+                                break;
+                }
+        }
+
+        if (install)
+        {
+                if (install_path)
+                        install_conf(install_path, pw->pw_uid, pw->pw_gid);
+                else
+                        install_conf(pw->pw_dir,pw->pw_uid, pw->pw_gid);
+        }
+
+        /* A dry run only shows what the first pass would do, wherever -n is. */
+        if (sync_once || (!ran && dry_run))
+        {
+                read_option (conf_path ? conf_path : pw->pw_dir, pw->pw_uid, pw->pw_gid);
+                /* The command line wins over the configuration file. */
+                if (jobs > 0)
+                        workers = jobs;
+                sched_init ();
+
+                /* Start the copy. */
+                sync_pairs ();
+        }
+        /* If nothing else was asked, just run. */
+        else if (!ran)
         {
                 read_option (pw->pw_dir, pw->pw_uid, pw->pw_gid);
+                if (jobs > 0)
+                        workers = jobs;
+                sched_init ();
 
                 daemon (0, 0);
 
                 /* Start the copy. */
-                chdir (dev_path);
-                read_dir (dev_path, src_path);
+                sync_pairs ();
 
                 cpusb_daemon ();
-
         }
-        /* If there are arguments, do you job. */
-        else
-                /* The loop should run until end arguments. */
-                while ((c = (char) getopt_long (argc, argv, short_options, 
-                                                long_options, 
-                                                &option_index)) != -1)
-                {
-                        option_index = 0;
-                        switch (c)
-                        {
-                                case 'f':
-                                        read_option (optarg, pw->pw_uid, pw->pw_gid);
-
-                                        /* Start the copy. */
-                                        chdir (dev_path);
-                                        read_dir (dev_path, src_path);
-
-                                        break;
-
-                                case 'h':
-                                        /** 
-                                         * \todo Implement the help() function.
-                                         */
-                                        printf("--help\n");
-                                        break;
-
-                                case 'i':
-                                        /** 
-                                         * \todo Improve the install() function.
-                                         */
-                                        if (optarg)
-                                                install_conf(optarg, pw->pw_uid, pw->pw_gid);
-                                        else
-                                                install_conf(pw->pw_dir,pw->pw_uid, pw->pw_gid);
-                                        break;
-
-                                default:
-                                        /**
-                                         * \todo There should be an error handling.
-                                         */
-                                        break;
-                        }
-                }
 }
 
 /**
@@ -677,6 +7643,7 @@ read_args (int argc, char *argv[])
 int
 main (int argc, char *argv[])
 {
+        metrics.started = now_us ();
         read_args (argc, argv);
 
         return (EXIT_SUCCESS);